@@ -15,133 +15,469 @@
  * License along with this library. If not, see <http://www.gnu.org/licenses/>. 
  */
 
+/* the SIMD kernels below handle runs of whole groups, the scalar code
+ * handles 'z' groups the decoder cannot vectorize and the final partial
+ * group, both produce identical output.
+ */
+#include <limits.h>
+
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+
+#ifndef A85_SIMD
+#if !defined(A85_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define A85_SIMD 1
+#else
+#define A85_SIMD 0
+#endif
+#endif
+
+#if A85_SIMD
+#include <immintrin.h>
+
+/* 1 for SSE2 and 2 for AVX2 */
+static int a85_simd_level (void)
+{
+  static int level = 0;
+  if (!level)
+  {
+    __builtin_cpu_init ();
+    level = __builtin_cpu_supports ("avx2") ? 2 : 1;
+  }
+  return level;
+}
+
+static inline __m128i a85_bswap32_sse2 (__m128i v)
+{
+  v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+  return _mm_shufflelo_epi16 (_mm_shufflehi_epi16 (v, 0xb1), 0xb1);
+}
+
+/* x / 85 == (x * 0xc0c0c0c1) >> 38 for all 32bit x */
+static inline __m128i a85_div85_sse2 (__m128i v)
+{
+  const __m128i magic = _mm_set1_epi32 ((int)0xc0c0c0c1);
+  __m128i even = _mm_srli_epi64 (_mm_mul_epu32 (v, magic), 38);
+  __m128i odd  = _mm_srli_epi64 (_mm_mul_epu32 (_mm_srli_epi64 (v, 32), magic), 38);
+  return _mm_or_si128 (even, _mm_slli_epi64 (odd, 32));
+}
+
+static inline __m128i a85_mul85_sse2 (__m128i v)
+{
+  return _mm_add_epi32 (_mm_add_epi32 (_mm_slli_epi32 (v, 6), _mm_slli_epi32 (v, 4)),
+                        _mm_add_epi32 (_mm_slli_epi32 (v, 2), v));
+}
+
+/* emits up to lanes groups from the packed first four digits and the last
+ * digit of each group, substituting 'z' for all zero groups
+ */
+static inline int a85enc_emit (char *dst, const uint32_t *head, const uint32_t *tail,
+                               int zero_mask, int lanes)
+{
+  int out_len = 0;
+  for (int l = 0; l < lanes; l++)
+  {
+    memcpy (dst + out_len, &head[l], 4);
+    dst[out_len + 4] = tail[l];
+    if (zero_mask & (1 << l))
+    {
+      dst[out_len] = 'z';
+      out_len += 1;
+    }
+    else
+    {
+      out_len += 5;
+    }
+  }
+  return out_len;
+}
+
+/* encodes whole groups four at a time, returns number of groups done */
+static int a85enc_sse2 (const uint8_t *src, char *dst, int groups, int *out_len)
+{
+  int i;
+  for (i = 0; i + 4 <= groups; i += 4)
+  {
+    __m128i v = a85_bswap32_sse2 (_mm_loadu_si128 ((const __m128i*)(src + i * 4)));
+    int zero_mask = _mm_movemask_ps (_mm_castsi128_ps (
+                      _mm_cmpeq_epi32 (v, _mm_setzero_si128 ())));
+    __m128i digit[5];
+    uint32_t head[4], tail[4];
+
+    for (int j = 4; j > 0; j--)
+    {
+      __m128i q = a85_div85_sse2 (v);
+      digit[j] = _mm_sub_epi32 (v, a85_mul85_sse2 (q));
+      v = q;
+    }
+    digit[0] = v;
+
+    v = _mm_or_si128 (_mm_or_si128 (digit[0], _mm_slli_epi32 (digit[1], 8)),
+                      _mm_or_si128 (_mm_slli_epi32 (digit[2], 16),
+                                    _mm_slli_epi32 (digit[3], 24)));
+    _mm_storeu_si128 ((__m128i*)head, _mm_add_epi8 (v, _mm_set1_epi8 ('!')));
+    _mm_storeu_si128 ((__m128i*)tail, _mm_add_epi32 (digit[4], _mm_set1_epi32 ('!')));
+    *out_len += a85enc_emit (dst + *out_len, head, tail, zero_mask, 4);
+  }
+  return i;
+}
+
+/* decodes whole groups four at a time as long as they consist only of
+ * digits, returns number of characters consumed.
+ */
+static int a85dec_sse2 (const char *srcp, char *dst, int count)
+{
+  const uint8_t *src = (const uint8_t*)srcp;
+  const __m128i lo = _mm_set1_epi8 ('!' - 1);
+  const __m128i hi = _mm_set1_epi8 ('u' + 1);
+  const __m128i bang = _mm_set1_epi32 ('!');
+  int i;
+
+  for (i = 0; i + 20 <= count; i += 20)
+  {
+    __m128i a = _mm_loadu_si128 ((const __m128i*)(src + i));
+    __m128i b = _mm_loadu_si128 ((const __m128i*)(src + i + 4));
+    __m128i ok = _mm_and_si128 (
+                   _mm_and_si128 (_mm_cmpgt_epi8 (a, lo), _mm_cmplt_epi8 (a, hi)),
+                   _mm_and_si128 (_mm_cmpgt_epi8 (b, lo), _mm_cmplt_epi8 (b, hi)));
+    if (_mm_movemask_epi8 (ok) != 0xffff)
+      break;
+
+    const uint8_t *s = src + i;
+    __m128i val = _mm_setzero_si128 ();
+    for (int j = 0; j < 5; j++)
+    {
+      __m128i c = _mm_setr_epi32 (s[j], s[5+j], s[10+j], s[15+j]);
+      val = _mm_add_epi32 (a85_mul85_sse2 (val), _mm_sub_epi32 (c, bang));
+    }
+    _mm_storeu_si128 ((__m128i*)(dst + i / 5 * 4), a85_bswap32_sse2 (val));
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static int a85enc_avx2 (const uint8_t *src, char *dst, int groups, int *out_len)
+{
+  const __m256i bswap = _mm256_setr_epi8 (3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+                                          3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+  const __m256i magic = _mm256_set1_epi32 ((int)0xc0c0c0c1);
+  const __m256i c85   = _mm256_set1_epi32 (85);
+  int i;
+  for (i = 0; i + 8 <= groups; i += 8)
+  {
+    __m256i v = _mm256_shuffle_epi8 (
+                  _mm256_loadu_si256 ((const __m256i*)(src + i * 4)), bswap);
+    int zero_mask = _mm256_movemask_ps (_mm256_castsi256_ps (
+                      _mm256_cmpeq_epi32 (v, _mm256_setzero_si256 ())));
+    __m256i digit[5];
+    uint32_t head[8], tail[8];
+
+    for (int j = 4; j > 0; j--)
+    {
+      __m256i even = _mm256_srli_epi64 (_mm256_mul_epu32 (v, magic), 38);
+      __m256i odd  = _mm256_srli_epi64 (
+                       _mm256_mul_epu32 (_mm256_srli_epi64 (v, 32), magic), 38);
+      __m256i q = _mm256_or_si256 (even, _mm256_slli_epi64 (odd, 32));
+      digit[j] = _mm256_sub_epi32 (v, _mm256_mullo_epi32 (q, c85));
+      v = q;
+    }
+    digit[0] = v;
+
+    v = _mm256_or_si256 (_mm256_or_si256 (digit[0], _mm256_slli_epi32 (digit[1], 8)),
+                         _mm256_or_si256 (_mm256_slli_epi32 (digit[2], 16),
+                                          _mm256_slli_epi32 (digit[3], 24)));
+    _mm256_storeu_si256 ((__m256i*)head, _mm256_add_epi8 (v, _mm256_set1_epi8 ('!')));
+    _mm256_storeu_si256 ((__m256i*)tail, _mm256_add_epi32 (digit[4], _mm256_set1_epi32 ('!')));
+    *out_len += a85enc_emit (dst + *out_len, head, tail, zero_mask, 8);
+  }
+  return i;
+}
+
+/* each 128bit lane of a85dec_avx2 decodes four groups from 20 characters,
+ * loaded as characters 0-15 in a and 4-19 in b, digit j of group g is
+ * character 5g+j which is picked from a when it is in range and from b
+ * otherwise, into the low byte of the group's 32bit lane
+ */
+#define A85_PICK(c0,c1,c2,c3) \
+  c0,-128,-128,-128, c1,-128,-128,-128, c2,-128,-128,-128, c3,-128,-128,-128, \
+  c0,-128,-128,-128, c1,-128,-128,-128, c2,-128,-128,-128, c3,-128,-128,-128
+
+static const int8_t a85dec_mask_a[5][32] = {
+  {A85_PICK (0, 5, 10, 15)},
+  {A85_PICK (1, 6, 11, -128)},
+  {A85_PICK (2, 7, 12, -128)},
+  {A85_PICK (3, 8, 13, -128)},
+  {A85_PICK (4, 9, 14, -128)},
+};
+
+static const int8_t a85dec_mask_b[5][32] = {
+  {A85_PICK (-128, -128, -128, -128)},
+  {A85_PICK (-128, -128, -128, 12)},
+  {A85_PICK (-128, -128, -128, 13)},
+  {A85_PICK (-128, -128, -128, 14)},
+  {A85_PICK (-128, -128, -128, 15)},
+};
+#undef A85_PICK
+
+__attribute__((target("avx2")))
+static int a85dec_avx2 (const char *srcp, char *dst, int count)
+{
+  const uint8_t *src = (const uint8_t*)srcp;
+  const __m256i lo = _mm256_set1_epi8 ('!' - 1);
+  const __m256i hi = _mm256_set1_epi8 ('u' + 1);
+  const __m256i bang = _mm256_set1_epi32 ('!');
+  const __m256i c85  = _mm256_set1_epi32 (85);
+  const __m256i bswap = _mm256_setr_epi8 (3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+                                          3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+  int i;
+
+  for (i = 0; i + 40 <= count; i += 40)
+  {
+    __m256i x = _mm256_loadu_si256 ((const __m256i*)(src + i));
+    __m256i y = _mm256_loadu_si256 ((const __m256i*)(src + i + 8));
+    __m256i ok = _mm256_and_si256 (
+      _mm256_and_si256 (_mm256_cmpgt_epi8 (x, lo), _mm256_cmpgt_epi8 (hi, x)),
+      _mm256_and_si256 (_mm256_cmpgt_epi8 (y, lo), _mm256_cmpgt_epi8 (hi, y)));
+    if (_mm256_movemask_epi8 (ok) != -1)
+      break;
+
+    __m256i a = _mm256_inserti128_si256 (_mm256_castsi128_si256 (
+                  _mm_loadu_si128 ((const __m128i*)(src + i))),
+                  _mm_loadu_si128 ((const __m128i*)(src + i + 20)), 1);
+    __m256i b = _mm256_inserti128_si256 (_mm256_castsi128_si256 (
+                  _mm_loadu_si128 ((const __m128i*)(src + i + 4))),
+                  _mm_loadu_si128 ((const __m128i*)(src + i + 24)), 1);
+    __m256i val = _mm256_setzero_si256 ();
+    for (int j = 0; j < 5; j++)
+    {
+      __m256i c = _mm256_or_si256 (
+        _mm256_shuffle_epi8 (a, _mm256_loadu_si256 ((const __m256i*)a85dec_mask_a[j])),
+        _mm256_shuffle_epi8 (b, _mm256_loadu_si256 ((const __m256i*)a85dec_mask_b[j])));
+      val = _mm256_add_epi32 (_mm256_mullo_epi32 (val, c85), _mm256_sub_epi32 (c, bang));
+    }
+    _mm256_storeu_si256 ((__m256i*)(dst + i / 5 * 4), _mm256_shuffle_epi8 (val, bswap));
+  }
+  return i;
+}
+#endif
+
+static inline int a85enc_group (uint32_t input, char *dst)
+{
+  if (input == 0)
+  {
+    dst[0] = 'z';
+    return 1;
+  }
+  for (int j = 4; j >= 0; j--)
+  {
+    dst[j] = (input % 85) + '!';
+    input /= 85;
+  }
+  return 5;
+}
+
 static int a85enc (const void *srcp, char *dst, int count)
 {
   const uint8_t *src = srcp;
   int out_len = 0;
+  int groups = count / 4;
+  int remaining = count % 4;
+  int i = 0;
 
-  int padding = 4-(count % 4);
-  if (padding == 4) padding = 0;
+#if A85_SIMD
+  if (a85_simd_level () >= 2)
+    i = a85enc_avx2 (src, dst, groups, &out_len);
+  i += a85enc_sse2 (src + i * 4, dst, groups - i, &out_len);
+#endif
+
+  for (; i < groups; i ++)
+  {
+    uint32_t input = ((uint32_t)src[i*4] << 24) | (src[i*4+1] << 16) |
+                     (src[i*4+2] << 8) | src[i*4+3];
+    out_len += a85enc_group (input, &dst[out_len]);
+  }
 
-  for (int i = 0; i < (count+3)/4; i ++)
+  /* a partial final group is zero padded and never abbreviated to 'z',
+   * only the remaining+1 leading digits are emitted
+   */
+  if (remaining)
   {
     uint32_t input = 0;
+    char digits[5];
     for (int j = 0; j < 4; j++)
     {
       input = (input << 8);
-      if (i*4+j<=count)
-        input += src[i*4+j];
+      if (j < remaining)
+        input += src[groups*4+j];
     }
-
-    int divisor = 85 * 85 * 85 * 85;
-    if (input == 0)
+    for (int j = 4; j >= 0; j--)
     {
-        dst[out_len++] = 'z';
-    }
-    else
-    {
-      for (int j = 0; j < 5; j++)
-      {
-        dst[out_len++] = ((input / divisor) % 85) + '!';
-        divisor /= 85;
-      }
+      digits[j] = (input % 85) + '!';
+      input /= 85;
     }
+    memcpy (&dst[out_len], digits, remaining + 1);
+    out_len += remaining + 1;
   }
 
-  out_len -= padding;
-
   dst[out_len++]='~';
   dst[out_len]=0;
   return out_len;
 }
 
-static int a85dec (const char *src, char *dst, int count)
+/* incremental decoder state, allowing a payload to be decoded in pieces
+ * as it arrives, zero initialize before the first piece.
+ */
+typedef struct A85Dec {
+  uint32_t val;   /* digits of the partial group */
+  int      k;     /* number of digits in val */
+  int      done;  /* the '~' terminator has been seen */
+} A85Dec;
+
+/* decodes as much of count characters as fits whole in capacity bytes of
+ * dst, returns the number of bytes written and stores the number of
+ * characters used in consumed, the rest should be fed again once dst has
+ * been drained. Characters after the terminator are consumed and ignored.
+ */
+static int a85dec_stream (A85Dec *dec, const char *src, int count,
+                          char *dst, int capacity, int *consumed)
 {
   int out_len = 0;
-  uint32_t val = 0;
-  int k = 0;
+  uint32_t val = dec->val;
+  int k = dec->k;
+  int i = 0;
+#if A85_SIMD
+  int simd_level = a85_simd_level ();
+  int simd_stop = -1;
+#endif
 
-  for (int i = 0; i < count; i ++, k++)
+  while (i < count && !dec->done)
   {
-    val *= 85;
+#if A85_SIMD
+    /* at a group boundary, decode runs of plain groups in bulk, retrying
+     * once per group after a run was stopped, but not on a 'z' or the
+     * terminator which the bulk decoders would stop at right away
+     */
+    if (k == 0 && i > simd_stop && src[i] != 'z' && src[i] != '~')
+    {
+      int limit = count - i;
+      if ((capacity - out_len) / 4 < limit / 5)
+        limit = (capacity - out_len) / 4 * 5;
+      int done = 0;
+      if (simd_level >= 2)
+        done = a85dec_avx2 (src + i, dst + out_len, limit);
+      done += a85dec_sse2 (src + i + done, dst + out_len + done / 5 * 4,
+                           limit - done);
+      i += done;
+      out_len += done / 5 * 4;
+      simd_stop = i;
+      if (i >= count)
+        break;
+    }
+#endif
 
     if (src[i] == '~')
-      break;
+    {
+      dec->done = 1;
+    }
     else if (src[i] == 'z')
     {
+      if (out_len + 4 > capacity)
+        break;
       for (int j = 0; j < 4; j++)
         dst[out_len++] = 0;
+      val = 0;
       k = 0;
     }
     else
     {
-      val += src[i]-'!';
-      if (k % 5 == 4)
+      if (k == 4 && out_len + 4 > capacity)
+        break;
+      val = val * 85 + (src[i]-'!');
+      if (++k == 5)
       {
          for (int j = 0; j < 4; j++)
          {
-           dst[out_len++] = (val & (0xff << 24)) >> 24;
+           dst[out_len++] = val >> 24;
            val <<= 8;
          }
          val = 0;
+         k = 0;
       }
     }
+    i++;
   }
-  k = k % 5;
-  if (k)
+  if (dec->done)
+    i = count;
+
+  dec->val = val;
+  dec->k = k;
+  *consumed = i;
+  return out_len;
+}
+
+/* flushes the partial final group, padded with the highest digit, into
+ * dst which needs room for 3 bytes, returns the number of bytes written
+ */
+static int a85dec_stream_end (A85Dec *dec, char *dst)
+{
+  uint32_t val = dec->val;
+  int out_len = 0;
+  if (dec->k)
   {
-    val += 84;
-    for (int j = k; j < 4; j++)
-    {
-      val *= 85;
-      val += 84;
-    }
+    for (int j = dec->k; j < 5; j++)
+      val = val * 85 + 84;
 
-    for (int j = 0; j < k-1; j++)
+    for (int j = 0; j < dec->k-1; j++)
     {
-      dst[out_len++] = (val & (0xff << 24)) >> 24;
+      dst[out_len++] = val >> 24;
       val <<= 8;
     }
-    val = 0;
   }
-  dst[out_len]=0;
+  dec->val = 0;
+  dec->k = 0;
   return out_len;
 }
 
-static int a85len (const char *src, int count)
+/* decodes count characters of ascii85 into dst in a single pass, writing
+ * at most capacity bytes followed by a terminating 0, returns the number
+ * of bytes decoded.
+ */
+static inline int a85dec_bounded (const char *src, char *dst, int count, int capacity)
 {
-  int out_len = 0;
-  int k = 0;
+  A85Dec dec = {0, 0, 0};
+  int consumed;
+  int out_len = a85dec_stream (&dec, src, count, dst, capacity, &consumed);
 
-  for (int i = 0; i < count; i ++, k++)
+  /* a payload cut short by the capacity has no final group to flush */
+  if (consumed == count)
   {
-    if (src[i] == '~')
-      break;
-    else if (src[i] == 'z')
-    {
-      for (int j = 0; j < 4; j++)
-        out_len++;
-      k = 0;
-    }
-    else
-    {
-      if (k % 5 == 4)
-      {
-         out_len += 4;
-      }
-    }
-  }
-  k = k % 5;
-  if (k)
-  {
-    for (int j = 0; j < k-1; j++)
-    {
-      out_len++;
-    }
+    char tail[4];
+    int len = a85dec_stream_end (&dec, tail);
+    if (len > capacity - out_len)
+      len = capacity - out_len;
+    memcpy (dst + out_len, tail, len);
+    out_len += len;
   }
+  dst[out_len]=0;
   return out_len;
 }
 
+/* decodes count characters, dst must have room for a85dec_max (count) */
+static inline int a85dec (const char *src, char *dst, int count)
+{
+  return a85dec_bounded (src, dst, count, INT_MAX);
+}
+
+/* upper bound on the decoded size of count characters, each 'z' could
+ * expand to four bytes
+ */
+static inline int a85dec_max (int count)
+{
+  return count * 4 + 1;
+}
+
 
 #if 0
 static void test_a85 (void)
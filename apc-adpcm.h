@@ -0,0 +1,187 @@
+/* atty - audio interface and driver for terminals
+ * Copyright (C) 2020 Øyvind Kolås <pippin@gimp.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* o=i, IMA ADPCM of 16bit samples at 4 bits per sample.
+ *
+ * A payload starts with the decoder state for each channel, a little
+ * endian 16bit predictor, the step index and a zero byte. The nibbles
+ * follow, low nibble first, interleaved like the samples, so a stereo
+ * byte holds one frame and a mono byte two. Each packet can be decoded
+ * on its own, the final nibble of an odd mono packet is padding.
+ *
+ * The decoder works on all channels of a frame in lockstep with the
+ * per-nibble arithmetic of the reference decoder folded into a table,
+ * there are no branches in the inner loop apart from the clamping.
+ */
+#include <stdint.h>
+
+#define APC_ADPCM_HEADER 4  /* bytes per channel */
+
+static const int16_t apc_adpcm_steps[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41,
+  45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190,
+  209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724,
+  796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272,
+  2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132,
+  7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500,
+  20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t apc_adpcm_index_adjust[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+typedef struct ApcAdpcm {
+  int pred[2];
+  int index[2];
+} ApcAdpcm;
+
+/* signed predictor delta for every step index and nibble, as computed by
+ * the shift and add sequence of the reference decoder
+ */
+static int32_t apc_adpcm_delta[89][16];
+static uint8_t apc_adpcm_next[89][16];
+
+static inline void apc_adpcm_init_tables (void)
+{
+  static int done = 0;
+  if (done)
+    return;
+  for (int index = 0; index < 89; index++)
+    for (int nibble = 0; nibble < 16; nibble++)
+    {
+      int step = apc_adpcm_steps[index];
+      int diff = step >> 3;
+      int next = index + apc_adpcm_index_adjust[nibble];
+      if (nibble & 4) diff += step;
+      if (nibble & 2) diff += step >> 1;
+      if (nibble & 1) diff += step >> 2;
+      apc_adpcm_delta[index][nibble] = (nibble & 8) ? -diff : diff;
+      apc_adpcm_next[index][nibble]  = next < 0 ? 0 : next > 88 ? 88 : next;
+    }
+  done = 1;
+}
+
+static inline int apc_adpcm_bytes (int frames, int channels)
+{
+  return APC_ADPCM_HEADER * channels + (frames * channels + 1) / 2;
+}
+
+static inline int apc_adpcm_step (ApcAdpcm *s, int c, int nibble)
+{
+  int pred = s->pred[c] + apc_adpcm_delta[s->index[c]][nibble];
+  pred = pred < -32768 ? -32768 : pred > 32767 ? 32767 : pred;
+  s->index[c] = apc_adpcm_next[s->index[c]][nibble];
+  s->pred[c]  = pred;
+  return pred;
+}
+
+static inline void apc_adpcm_write_header (ApcAdpcm *s, int channels, uint8_t *dst)
+{
+  for (int c = 0; c < channels; c++)
+  {
+    dst[c * 4 + 0] = s->pred[c] & 0xff;
+    dst[c * 4 + 1] = (s->pred[c] >> 8) & 0xff;
+    dst[c * 4 + 2] = s->index[c];
+    dst[c * 4 + 3] = 0;
+  }
+}
+
+static inline void apc_adpcm_read_header (ApcAdpcm *s, int channels, const uint8_t *src)
+{
+  for (int c = 0; c < channels; c++)
+  {
+    s->pred[c]  = (int16_t)(src[c * 4] | (src[c * 4 + 1] << 8));
+    s->index[c] = src[c * 4 + 2] > 88 ? 88 : src[c * 4 + 2];
+  }
+}
+
+/* encodes frames of interleaved 16bit samples, the state carries over to
+ * the next packet, returns the number of bytes written
+ */
+static inline int apc_adpcm_encode (ApcAdpcm *s, int channels,
+                                    const int16_t *src, int frames, uint8_t *dst)
+{
+  int count = frames * channels;
+  uint8_t *out = dst + APC_ADPCM_HEADER * channels;
+
+  apc_adpcm_init_tables ();
+  apc_adpcm_write_header (s, channels, dst);
+
+  for (int i = 0; i < count; i++)
+  {
+    int c      = i % channels;
+    int step   = apc_adpcm_steps[s->index[c]];
+    int diff   = src[i] - s->pred[c];
+    int nibble = 0;
+
+    if (diff < 0)
+    {
+      nibble = 8;
+      diff = -diff;
+    }
+    if (diff >= step)      { nibble |= 4; diff -= step; }
+    if (diff >= step >> 1) { nibble |= 2; diff -= step >> 1; }
+    if (diff >= step >> 2) { nibble |= 1; }
+
+    apc_adpcm_step (s, c, nibble);
+    if (i & 1)
+      out[i / 2] |= nibble << 4;
+    else
+      out[i / 2] = nibble;
+  }
+  return apc_adpcm_bytes (frames, channels);
+}
+
+/* decodes count bytes of nibbles into frames of out_channels interleaved
+ * samples, a mono stream decoded with two out_channels is duplicated.
+ * Returns the number of frames written, which is 2 * count for mono and
+ * count for stereo.
+ */
+static inline int apc_adpcm_decode (ApcAdpcm *s, int channels,
+                                    const uint8_t *src, int count,
+                                    int16_t *dst, int out_channels)
+{
+  apc_adpcm_init_tables ();
+
+  if (channels == 2)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      dst[i * 2]     = apc_adpcm_step (s, 0, src[i] & 15);
+      dst[i * 2 + 1] = apc_adpcm_step (s, 1, src[i] >> 4);
+    }
+    return count;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    int16_t a = apc_adpcm_step (s, 0, src[i] & 15);
+    int16_t b = apc_adpcm_step (s, 0, src[i] >> 4);
+    if (out_channels == 2)
+    {
+      dst[i * 4] = dst[i * 4 + 1] = a;
+      dst[i * 4 + 2] = dst[i * 4 + 3] = b;
+    }
+    else
+    {
+      dst[i * 2]     = a;
+      dst[i * 2 + 1] = b;
+    }
+  }
+  return count * 2;
+}
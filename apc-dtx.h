@@ -0,0 +1,112 @@
+/* atty - audio interface and driver for terminals
+ * Copyright (C) 2020 Øyvind Kolås <pippin@gimp.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* discontinuous transmission, with d= set to a level a sender replaces
+ * packets whose RMS level, in 16bit units, stays below it with
+ *
+ *   ESC _ A a=s,f=<frames>,n=<level> ; ESC \
+ *
+ * and the receiver fills the gap with noise of that level. The first
+ * APC_DTX_HANGOVER quiet packets are still sent, to not cut off the
+ * tails of sounds.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "apc-ulaw.h"
+
+#define APC_DTX_HANGOVER 3
+
+typedef struct ApcDtx {
+  int quiet_packets;
+} ApcDtx;
+
+/* RMS of a packet in 16bit units */
+static inline int apc_dtx_level (const uint8_t *src, int frames, int channels,
+                                 int type, int bits)
+{
+  int count = frames * channels;
+  uint64_t sum = 0;
+  uint64_t root = 0;
+
+  if (count <= 0)
+    return 0;
+  if (type == 'u')
+    apc_ulaw_init_tables ();
+  for (int i = 0; i < count; i++)
+  {
+    int64_t val;
+    if (type == 'u')
+      val = apc_ulaw_decode_table[src[i]];
+    else if (type == 'f')
+    {
+      float valf;
+      memcpy (&valf, src + i * 4, 4);
+      val = !(valf == valf) ? 0 : valf < -1.0f ? -32768 : valf > 1.0f ? 32767
+                                : (int64_t)(valf * 32767.0f);
+    }
+    else if (bits == 8)
+      val = (int8_t)src[i] * 256;
+    else if (bits == 24)
+      val = (int8_t)src[i * 3 + 2] * 256 + src[i * 3 + 1];
+    else if (bits == 32)
+      val = (int8_t)src[i * 4 + 3] * 256 + src[i * 4 + 2];
+    else
+    {
+      int16_t val16;
+      memcpy (&val16, src + i * 2, 2);
+      val = val16;
+    }
+    sum += val * val;
+  }
+  sum /= count;
+
+  /* integer square root */
+  for (uint64_t bit = (uint64_t)1 << 62; bit; bit >>= 2)
+  {
+    if (sum >= root + bit)
+    {
+      sum -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+    {
+      root >>= 1;
+    }
+  }
+  return root;
+}
+
+/* decides whether a packet of the given level is replaced by a silence
+ * message, threshold 0 disables
+ */
+static inline int apc_dtx_quiet (ApcDtx *dtx, int threshold, int level)
+{
+  if (threshold <= 0 || level >= threshold)
+  {
+    dtx->quiet_packets = 0;
+    return 0;
+  }
+  dtx->quiet_packets++;
+  return dtx->quiet_packets > APC_DTX_HANGOVER;
+}
+
+/* writes the silence message for a suppressed packet, returns its length */
+static inline int apc_dtx_message (char *dst, int frames, int level)
+{
+  return sprintf (dst, "\033_Aa=s,f=%i,n=%i;\033\\", frames, level);
+}
@@ -0,0 +1,63 @@
+/* atty - audio interface and driver for terminals
+ * Copyright (C) 2020 Øyvind Kolås <pippin@gimp.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* framing of outgoing audio packets in a single buffer.
+ *
+ * The payload is encoded at APC_FRAME_HEADROOM into the buffer, which
+ * leaves room for the longest header in front of it. Once the payload
+ * length is known the header is put right before the payload and the
+ * terminator after it, and the whole packet goes out with one write.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#define APC_FRAME_HEADROOM 64
+
+/* buffer size for a packet with count bytes of payload before encoding.
+ * base64 needs 4 characters per 3 bytes. ascii85 needs 5 per 4, one more
+ * than the bytes of a partial group and the closing ~, which is more than
+ * base64 for short payloads. The terminating 0 of the encoders is
+ * overwritten by the 2 byte terminator.
+ */
+static inline int apc_frame_size (int count)
+{
+  int base64  = (count + 2) / 3 * 4;
+  int ascii85 = count / 4 * 5 + count % 4 + 1 + 1;
+  return APC_FRAME_HEADROOM + (base64 > ascii85 ? base64 : ascii85) + 2;
+}
+
+static inline char *apc_frame_payload (char *buf)
+{
+  return buf + APC_FRAME_HEADROOM;
+}
+
+/* adds the header and terminator around payload_len encoded bytes,
+ * returns the start of the packet and its length in len
+ */
+static inline char *apc_frame_seal (char *buf, int payload_len, int frames,
+                                    const char *extra, int *len)
+{
+  char header[APC_FRAME_HEADROOM];
+  int  header_len = snprintf (header, sizeof (header), "\033_Af=%i%s;",
+                              frames, extra);
+  char *start = buf + APC_FRAME_HEADROOM - header_len;
+
+  memcpy (start, header, header_len);
+  memcpy (buf + APC_FRAME_HEADROOM + payload_len, "\033\\", 2);
+  *len = header_len + payload_len + 2;
+  return start;
+}
@@ -0,0 +1,334 @@
+/* atty - audio interface and driver for terminals
+ * Copyright (C) 2020 Øyvind Kolås <pippin@gimp.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* o=l, a lossless codec in the spirit of FLAC's fixed predictors.
+ *
+ * The payload holds each channel of the packet in turn, starting at a
+ * byte boundary with a byte that has the predictor order 0-4 in the upper
+ * three bits and the rice parameter in the lower five. Order 7 means the
+ * samples follow verbatim, which bounds the payload at the raw size plus
+ * one byte per channel. The first samples of a channel use the lower
+ * orders their history permits.
+ *
+ * Residuals are zigzag mapped and rice coded MSB first, a unary quotient
+ * of APC_LOSSLESS_ESCAPE ones is followed by the mapped residual in 32
+ * bits. The number of frames is the f= of the packet.
+ *
+ * ulaw codes are predicted in their sign/magnitude order, which is
+ * monotonic in the linear value. 32bit samples, integer or float, would
+ * overflow the predictors and are always sent verbatim.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+
+#define APC_LOSSLESS_ESCAPE    24
+#define APC_LOSSLESS_VERBATIM  7
+#define APC_LOSSLESS_MAX_ORDER 4
+
+static inline int apc_lossless_bytes_per_sample (int type, int bits)
+{
+  return type == 'u' ? 1 : bits / 8;
+}
+
+/* upper bound for the encoded size of a packet, in size_t so that a
+ * frame count from a header can not wrap it around
+ */
+static inline size_t apc_lossless_bound (int frames, int channels, int type, int bits)
+{
+  return (size_t)frames * channels * apc_lossless_bytes_per_sample (type, bits) +
+         channels;
+}
+
+static inline int32_t apc_lossless_get (const uint8_t *src, int i, int type, int bits)
+{
+  if (type == 'u')
+  {
+    int c = ~src[i] & 0xff;
+    return (c & 0x80) ? -1 - (c & 0x7f) : c;
+  }
+  else if (bits == 8)
+  {
+    return (int8_t)src[i];
+  }
+  else if (bits == 24)
+  {
+    src += i * 3;
+    return (int32_t)((uint32_t)src[0] << 8 | (uint32_t)src[1] << 16 |
+                     (uint32_t)src[2] << 24) >> 8;
+  }
+  else
+  {
+    int16_t val;
+    memcpy (&val, src + i * 2, 2);
+    return val;
+  }
+}
+
+static inline void apc_lossless_put (uint8_t *dst, int i, int32_t val, int type, int bits)
+{
+  if (type == 'u')
+  {
+    int c = val < 0 ? 0x80 | ((-1 - val) & 0x7f) : (val & 0x7f);
+    dst[i] = ~c;
+  }
+  else if (bits == 8)
+  {
+    dst[i] = val;
+  }
+  else if (bits == 24)
+  {
+    dst[i * 3]     = val & 0xff;
+    dst[i * 3 + 1] = (val >> 8) & 0xff;
+    dst[i * 3 + 2] = (val >> 16) & 0xff;
+  }
+  else
+  {
+    int16_t val16 = val;
+    memcpy (dst + i * 2, &val16, 2);
+  }
+}
+
+/* fixed polynomial predictors for sample i of an interleaved buffer with
+ * the given stride
+ */
+static inline int32_t apc_lossless_predict (const uint8_t *buf, int i, int stride,
+                                            int order, int type, int bits)
+{
+#define X(n) apc_lossless_get (buf, i - (n) * stride, type, bits)
+  switch (order)
+  {
+    case 1: return X(1);
+    case 2: return 2 * X(1) - X(2);
+    case 3: return 3 * X(1) - 3 * X(2) + X(3);
+    case 4: return 4 * X(1) - 6 * X(2) + 4 * X(3) - X(4);
+  }
+#undef X
+  return 0;
+}
+
+typedef struct ApcBits {
+  uint8_t       *dst;
+  const uint8_t *src;
+  int            pos;
+  int            len;   // capacity when writing, available when reading
+  uint64_t       acc;
+  int            count; // bits held in acc
+} ApcBits;
+
+static inline void apc_bits_put (ApcBits *b, uint32_t value, int count)
+{
+  if (count == 0)
+    return;
+  b->acc = (b->acc << count) | (value & (0xffffffffu >> (32 - count)));
+  b->count += count;
+  while (b->count >= 8)
+  {
+    b->count -= 8;
+    if (b->pos < b->len)
+      b->dst[b->pos] = b->acc >> b->count;
+    b->pos++;
+  }
+}
+
+static inline void apc_bits_flush (ApcBits *b)
+{
+  if (b->count)
+    apc_bits_put (b, 0, 8 - b->count);
+}
+
+static inline uint32_t apc_bits_get (ApcBits *b, int count)
+{
+  if (count == 0)
+    return 0;
+  while (b->count < count)
+  {
+    b->acc = (b->acc << 8) | (b->pos < b->len ? b->src[b->pos] : 0);
+    b->pos++;
+    b->count += 8;
+  }
+  b->count -= count;
+  return (b->acc >> b->count) & (0xffffffffu >> (32 - count));
+}
+
+/* bytes consumed by a reader, after dropping the padding of the last
+ * partially read byte
+ */
+static inline int apc_bits_consumed (ApcBits *b)
+{
+  return b->pos - b->count / 8;
+}
+
+/* writes one channel as raw samples, returns the length */
+static inline int apc_lossless_verbatim (const uint8_t *x, int frames, int channels,
+                                         int bps, uint8_t *dst)
+{
+  int out = 0;
+  dst[out++] = APC_LOSSLESS_VERBATIM << 5;
+  for (int i = 0; i < frames; i++)
+  {
+    memcpy (dst + out, x + i * channels * bps, bps);
+    out += bps;
+  }
+  return out;
+}
+
+/* encodes frames of interleaved samples, dst needs room for
+ * apc_lossless_bound bytes, returns the encoded length
+ */
+static inline int apc_lossless_encode (const uint8_t *src, int frames, int channels,
+                                       int type, int bits, uint8_t *dst)
+{
+  int bps = apc_lossless_bytes_per_sample (type, bits);
+  int out = 0;
+
+  for (int c = 0; c < channels; c++)
+  {
+    const uint8_t *x = src + c * bps;
+    uint64_t best_sum = UINT64_MAX;
+    int order = 0;
+    int k = 0;
+    ApcBits b = {0,};
+
+    if (bps == 4)
+    {
+      out += apc_lossless_verbatim (x, frames, channels, bps, dst + out);
+      continue;
+    }
+
+    for (int o = 0; o <= APC_LOSSLESS_MAX_ORDER; o++)
+    {
+      uint64_t sum = 0;
+      for (int i = 0; i < frames; i++)
+      {
+        int32_t r = apc_lossless_get (x, i * channels, type, bits) -
+                    apc_lossless_predict (x, i * channels, channels, MIN (o, i), type, bits);
+        sum += r < 0 ? -(int64_t)r : r;
+      }
+      if (sum < best_sum)
+      {
+        best_sum = sum;
+        order = o;
+      }
+    }
+
+    /* the mean of the zigzag mapped residuals is about twice the mean
+     * magnitude, the rice parameter is its log2
+     */
+    while (k < 30 && ((uint64_t)frames << (k + 1)) <= best_sum * 2)
+      k++;
+
+    b.dst = dst + out + 1;
+    b.len = frames * bps;
+    for (int i = 0; i < frames && b.pos <= b.len; i++)
+    {
+      int32_t  r = apc_lossless_get (x, i * channels, type, bits) -
+                   apc_lossless_predict (x, i * channels, channels, MIN (order, i), type, bits);
+      uint32_t u = ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+      uint32_t q = u >> k;
+
+      if (q >= APC_LOSSLESS_ESCAPE)
+      {
+        apc_bits_put (&b, 0xffffffff, APC_LOSSLESS_ESCAPE);
+        apc_bits_put (&b, u, 32);
+      }
+      else
+      {
+        apc_bits_put (&b, ((1u << q) - 1) << 1, q + 1);
+        apc_bits_put (&b, u, k);
+      }
+    }
+    apc_bits_flush (&b);
+
+    if (b.pos <= b.len)
+    {
+      dst[out] = (order << 5) | k;
+      out += 1 + b.pos;
+    }
+    else
+    {
+      out += apc_lossless_verbatim (x, frames, channels, bps, dst + out);
+    }
+  }
+  return out;
+}
+
+/* decodes a packet into frames of interleaved samples, returns 0 on
+ * success and -1 for truncated or corrupt data
+ */
+static inline int apc_lossless_decode (const uint8_t *src, int len, int frames,
+                                       int channels, int type, int bits,
+                                       uint8_t *dst)
+{
+  int bps = apc_lossless_bytes_per_sample (type, bits);
+  int pos = 0;
+
+  for (int c = 0; c < channels; c++)
+  {
+    uint8_t *x = dst + c * bps;
+    int order, k;
+    ApcBits b = {0,};
+
+    if (pos >= len)
+      return -1;
+    order = src[pos] >> 5;
+    k     = src[pos] & 31;
+    pos++;
+
+    if (order == APC_LOSSLESS_VERBATIM)
+    {
+      if (len - pos < frames * bps)
+        return -1;
+      for (int i = 0; i < frames; i++)
+      {
+        memcpy (x + i * channels * bps, src + pos, bps);
+        pos += bps;
+      }
+      continue;
+    }
+    if (order > APC_LOSSLESS_MAX_ORDER || bps >= 4)
+      return -1;
+
+    b.src = src + pos;
+    b.len = len - pos;
+    for (int i = 0; i < frames; i++)
+    {
+      uint32_t q = 0;
+      uint32_t u;
+      int32_t  r;
+
+      while (q < APC_LOSSLESS_ESCAPE && apc_bits_get (&b, 1))
+        q++;
+      if (q == APC_LOSSLESS_ESCAPE)
+        u = apc_bits_get (&b, 32);
+      else
+        u = (q << k) | apc_bits_get (&b, k);
+      r = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+
+      r = (uint32_t)r + (uint32_t)apc_lossless_predict (x, i * channels, channels,
+                                                         MIN (order, i), type, bits);
+      apc_lossless_put (x, i * channels, r, type, bits);
+    }
+    if (b.pos > b.len)
+      return -1;
+    pos += apc_bits_consumed (&b);
+  }
+  return 0;
+}
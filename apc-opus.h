@@ -0,0 +1,111 @@
+/* atty - audio interface and driver for terminals
+ * Copyright (C) 2020 Øyvind Kolås <pippin@gimp.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* o=o payloads are a sequence of opus packets, each prefixed by its
+ * length as two big-endian bytes, the samples are always 16bit signed.
+ * The f= of the APC header counts the frames the sender fed the encoder,
+ * the padding of the last opus frame is dropped by the receiver.
+ */
+#ifdef HAVE_OPUS
+#include <opus.h>
+
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+
+#define APC_OPUS_PACKET_MAX  1275
+#define APC_OPUS_FRAME_MAX   5760  /* 120ms at 48khz, what a decoder may return */
+
+/* largest opus frame duration, 2.5 to 60ms, that fits in buffer_size
+ * frames
+ */
+static inline int apc_opus_frame_size (int samplerate, int buffer_size)
+{
+  static const int durations[] = {600, 400, 200, 100, 50, 25}; // 0.1ms
+  for (unsigned int i = 0; i < sizeof (durations)/sizeof (durations[0]); i++)
+  {
+    int frames = samplerate * durations[i] / 10000;
+    if (frames <= buffer_size)
+      return frames;
+  }
+  return samplerate / 400;
+}
+
+/* encodes frame_size frames of pcm, writing a length prefixed opus packet
+ * to dst, which needs room for APC_OPUS_PACKET_MAX + 2 bytes. Returns the
+ * number of bytes written or a negative opus error.
+ */
+static inline int apc_opus_encode (OpusEncoder *enc, const int16_t *pcm,
+                                      int frame_size, uint8_t *dst)
+{
+  int len = opus_encode (enc, pcm, frame_size, dst + 2, APC_OPUS_PACKET_MAX);
+  if (len < 0)
+    return len;
+  dst[0] = len >> 8;
+  dst[1] = len & 0xff;
+  return len + 2;
+}
+
+/* collects length prefixed opus packets from payload data that arrives in
+ * arbitrary pieces
+ */
+typedef struct ApcOpusUnpack {
+  uint8_t buf[2 + APC_OPUS_PACKET_MAX];
+  int     len;
+} ApcOpusUnpack;
+
+static inline int apc_opus_unpack_need (ApcOpusUnpack *u)
+{
+  return u->len < 2 ? 2 : 2 + ((u->buf[0] << 8) | u->buf[1]);
+}
+
+/* consumes bytes from *data until a packet is complete, returns its length
+ * with the packet at u->buf + 2, 0 when all of *data was consumed without
+ * completing one and -1 for an invalid length.
+ */
+static inline int apc_opus_unpack (ApcOpusUnpack *u, const uint8_t **data, int *len)
+{
+  if (u->len > 2 && u->len == apc_opus_unpack_need (u))
+    u->len = 0;
+
+  while (*len > 0)
+  {
+    int need = apc_opus_unpack_need (u);
+    int take;
+
+    if (need > (int)sizeof (u->buf))
+    {
+      u->len = 0;
+      return -1;
+    }
+    take = MIN (need - u->len, *len);
+    memcpy (u->buf + u->len, *data, take);
+    u->len += take;
+    *data  += take;
+    *len   -= take;
+
+    if (u->len == apc_opus_unpack_need (u))
+    {
+      if (u->len > 2)
+        return u->len - 2;
+      u->len = 0; /* skip empty packets */
+    }
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,305 @@
+/* atty - audio interface and driver for terminals
+ * Copyright (C) 2020 Øyvind Kolås <pippin@gimp.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* block converters between the transfer formats and 16bit samples.
+ *
+ * There is one decoder to interleaved 16bit stereo per sample type, bit
+ * depth and channel count, looked up with apc_pcm_decoder, and one
+ * encoder from 16bit samples per type and bit depth, looked up with
+ * apc_pcm_encoder. Samples are little endian, s24 is packed in three
+ * bytes. Deeper formats are truncated to their high 16 bits, floats are
+ * clipped to -1.0..1.0 and NaN plays as 0. With SSE2 the s8, s16, s32
+ * and f32 converters do 8 or 16 samples at a time.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+/* and apc-ulaw.h, included before this file */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef void (*ApcPcmDecode) (const uint8_t *src, int frames, int16_t *dst);
+typedef void (*ApcPcmEncode) (const int16_t *src, int count, uint8_t *dst);
+
+static inline int16_t apc_pcm_from_float (float val)
+{
+  if (!(val == val))
+    return 0;
+  val = val < -1.0f ? -1.0f : val > 1.0f ? 1.0f : val;
+  val = rintf (val * 32768.0f);
+  return val > 32767.0f ? 32767 : (int16_t)val;
+}
+
+/* writes sample i of a block with channels to dst as stereo */
+static inline void apc_pcm_put (int16_t *dst, int i, int channels, int16_t val)
+{
+  if (channels == 2)
+    dst[i] = val;
+  else
+    dst[i * 2] = dst[i * 2 + 1] = val;
+}
+
+#ifdef __SSE2__
+/* stores 8 samples, doubling them up for mono */
+static inline void apc_pcm_store8 (int16_t *dst, int i, int channels, __m128i val)
+{
+  if (channels == 2)
+  {
+    _mm_storeu_si128 ((__m128i*)(dst + i), val);
+  }
+  else
+  {
+    _mm_storeu_si128 ((__m128i*)(dst + i * 2),     _mm_unpacklo_epi16 (val, val));
+    _mm_storeu_si128 ((__m128i*)(dst + i * 2 + 8), _mm_unpackhi_epi16 (val, val));
+  }
+}
+#endif
+
+static inline void apc_pcm_ulaw (const uint8_t *src, int count, int16_t *dst, int channels)
+{
+  apc_ulaw_decode_block (src, count / channels, channels, dst);
+}
+
+static inline void apc_pcm_s8 (const uint8_t *src, int count, int16_t *dst, int channels)
+{
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= count; i += 16)
+  {
+    __m128i in = _mm_loadu_si128 ((const __m128i*)(src + i));
+    apc_pcm_store8 (dst, i,     channels, _mm_unpacklo_epi8 (_mm_setzero_si128 (), in));
+    apc_pcm_store8 (dst, i + 8, channels, _mm_unpackhi_epi8 (_mm_setzero_si128 (), in));
+  }
+#endif
+  for (; i < count; i++)
+    apc_pcm_put (dst, i, channels, (int16_t)((int8_t)src[i] * 256));
+}
+
+static inline void apc_pcm_s16 (const uint8_t *src, int count, int16_t *dst, int channels)
+{
+  int i = 0;
+  if (channels == 2)
+  {
+    memcpy (dst, src, count * 2);
+    return;
+  }
+#ifdef __SSE2__
+  for (; i + 8 <= count; i += 8)
+    apc_pcm_store8 (dst, i, channels, _mm_loadu_si128 ((const __m128i*)(src + i * 2)));
+#endif
+  for (; i < count; i++)
+  {
+    int16_t val;
+    memcpy (&val, src + i * 2, 2);
+    apc_pcm_put (dst, i, channels, val);
+  }
+}
+
+static inline void apc_pcm_s24 (const uint8_t *src, int count, int16_t *dst, int channels)
+{
+  for (int i = 0; i < count; i++)
+    apc_pcm_put (dst, i, channels, (int16_t)(src[i * 3 + 1] | (src[i * 3 + 2] << 8)));
+}
+
+static inline void apc_pcm_s32 (const uint8_t *src, int count, int16_t *dst, int channels)
+{
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i a = _mm_srai_epi32 (_mm_loadu_si128 ((const __m128i*)(src + i * 4)), 16);
+    __m128i b = _mm_srai_epi32 (_mm_loadu_si128 ((const __m128i*)(src + i * 4 + 16)), 16);
+    apc_pcm_store8 (dst, i, channels, _mm_packs_epi32 (a, b));
+  }
+#endif
+  for (; i < count; i++)
+    apc_pcm_put (dst, i, channels, (int16_t)(src[i * 4 + 2] | (src[i * 4 + 3] << 8)));
+}
+
+static inline void apc_pcm_f32 (const uint8_t *src, int count, int16_t *dst, int channels)
+{
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i *in = (const __m128i*)src;
+  const __m128 lo    = _mm_set1_ps (-1.0f);
+  const __m128 hi    = _mm_set1_ps (1.0f);
+  const __m128 scale = _mm_set1_ps (32768.0f);
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i out[2];
+    for (int j = 0; j < 2; j++)
+    {
+      __m128 val = _mm_castsi128_ps (_mm_loadu_si128 (in + i / 4 + j));
+      val    = _mm_and_ps (val, _mm_cmpord_ps (val, val));
+      val    = _mm_min_ps (_mm_max_ps (val, lo), hi);
+      out[j] = _mm_cvtps_epi32 (_mm_mul_ps (val, scale));
+    }
+    /* 1.0 becomes 32768, which the pack saturates */
+    apc_pcm_store8 (dst, i, channels, _mm_packs_epi32 (out[0], out[1]));
+  }
+#endif
+  for (; i < count; i++)
+  {
+    float val;
+    memcpy (&val, src + i * 4, 4);
+    apc_pcm_put (dst, i, channels, apc_pcm_from_float (val));
+  }
+}
+
+#define APC_PCM_CONVERTERS(name) \
+static void name##_mono (const uint8_t *src, int frames, int16_t *dst) \
+{ name (src, frames, dst, 1); } \
+static void name##_stereo (const uint8_t *src, int frames, int16_t *dst) \
+{ name (src, frames * 2, dst, 2); }
+
+APC_PCM_CONVERTERS(apc_pcm_ulaw)
+APC_PCM_CONVERTERS(apc_pcm_s8)
+APC_PCM_CONVERTERS(apc_pcm_s16)
+APC_PCM_CONVERTERS(apc_pcm_s24)
+APC_PCM_CONVERTERS(apc_pcm_s32)
+APC_PCM_CONVERTERS(apc_pcm_f32)
+
+static const struct {
+  char         type;
+  char         bits;
+  ApcPcmDecode mono;
+  ApcPcmDecode stereo;
+} apc_pcm_decoders[] = {
+  {'u',  8, apc_pcm_ulaw_mono, apc_pcm_ulaw_stereo},
+  {'s',  8, apc_pcm_s8_mono,   apc_pcm_s8_stereo},
+  {'s', 16, apc_pcm_s16_mono,  apc_pcm_s16_stereo},
+  {'s', 24, apc_pcm_s24_mono,  apc_pcm_s24_stereo},
+  {'s', 32, apc_pcm_s32_mono,  apc_pcm_s32_stereo},
+  {'f', 32, apc_pcm_f32_mono,  apc_pcm_f32_stereo},
+};
+
+/* the converter for a format, or NULL when it is not supported */
+static inline ApcPcmDecode apc_pcm_decoder (int type, int bits, int channels)
+{
+  if (type == 'u')
+    bits = 8;
+  for (unsigned i = 0; i < sizeof (apc_pcm_decoders) / sizeof (apc_pcm_decoders[0]); i++)
+    if (apc_pcm_decoders[i].type == type && apc_pcm_decoders[i].bits == bits)
+      return channels == 2 ? apc_pcm_decoders[i].stereo : apc_pcm_decoders[i].mono;
+  return NULL;
+}
+
+static void apc_pcm_encode_ulaw (const int16_t *src, int count, uint8_t *dst)
+{
+  apc_ulaw_encode_block (src, count, dst);
+}
+
+static void apc_pcm_encode_s8 (const int16_t *src, int count, uint8_t *dst)
+{
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= count; i += 16)
+  {
+    __m128i a = _mm_srai_epi16 (_mm_loadu_si128 ((const __m128i*)(src + i)), 8);
+    __m128i b = _mm_srai_epi16 (_mm_loadu_si128 ((const __m128i*)(src + i + 8)), 8);
+    _mm_storeu_si128 ((__m128i*)(dst + i), _mm_packs_epi16 (a, b));
+  }
+#endif
+  for (; i < count; i++)
+    dst[i] = src[i] >> 8;
+}
+
+static void apc_pcm_encode_s16 (const int16_t *src, int count, uint8_t *dst)
+{
+  memcpy (dst, src, count * 2);
+}
+
+static void apc_pcm_encode_s24 (const int16_t *src, int count, uint8_t *dst)
+{
+  for (int i = 0; i < count; i++)
+  {
+    dst[i * 3]     = 0;
+    dst[i * 3 + 1] = src[i] & 0xff;
+    dst[i * 3 + 2] = (src[i] >> 8) & 0xff;
+  }
+}
+
+static void apc_pcm_encode_s32 (const int16_t *src, int count, uint8_t *dst)
+{
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i in = _mm_loadu_si128 ((const __m128i*)(src + i));
+    _mm_storeu_si128 ((__m128i*)(dst + i * 4),      _mm_unpacklo_epi16 (_mm_setzero_si128 (), in));
+    _mm_storeu_si128 ((__m128i*)(dst + i * 4 + 16), _mm_unpackhi_epi16 (_mm_setzero_si128 (), in));
+  }
+#endif
+  for (; i < count; i++)
+  {
+    int32_t val = (int32_t)((uint32_t)(uint16_t)src[i] << 16);
+    memcpy (dst + i * 4, &val, 4);
+  }
+}
+
+static void apc_pcm_encode_f32 (const int16_t *src, int count, uint8_t *dst)
+{
+  int i = 0;
+#ifdef __SSE2__
+  const __m128 scale = _mm_set1_ps (1.0f / 32768.0f);
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i in = _mm_loadu_si128 ((const __m128i*)(src + i));
+    __m128i lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (in, in), 16);
+    __m128i hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (in, in), 16);
+    _mm_storeu_ps ((float*)(dst + i * 4),      _mm_mul_ps (_mm_cvtepi32_ps (lo), scale));
+    _mm_storeu_ps ((float*)(dst + i * 4 + 16), _mm_mul_ps (_mm_cvtepi32_ps (hi), scale));
+  }
+#endif
+  for (; i < count; i++)
+  {
+    float val = src[i] * (1.0f / 32768.0f);
+    memcpy (dst + i * 4, &val, 4);
+  }
+}
+
+static const struct {
+  char         type;
+  char         bits;
+  ApcPcmEncode encode;
+} apc_pcm_encoders[] = {
+  {'u',  8, apc_pcm_encode_ulaw},
+  {'s',  8, apc_pcm_encode_s8},
+  {'s', 16, apc_pcm_encode_s16},
+  {'s', 24, apc_pcm_encode_s24},
+  {'s', 32, apc_pcm_encode_s32},
+  {'f', 32, apc_pcm_encode_f32},
+};
+
+/* the encoder for a format, or NULL when it is not supported */
+static inline ApcPcmEncode apc_pcm_encoder (int type, int bits)
+{
+  if (type == 'u')
+    bits = 8;
+  for (unsigned i = 0; i < sizeof (apc_pcm_encoders) / sizeof (apc_pcm_encoders[0]); i++)
+    if (apc_pcm_encoders[i].type == type && apc_pcm_encoders[i].bits == bits)
+      return apc_pcm_encoders[i].encode;
+  return NULL;
+}
+
+/* bytes per sample of a format */
+static inline int apc_pcm_sample_bytes (int type, int bits)
+{
+  return type == 'u' ? 1 : bits / 8;
+}
@@ -0,0 +1,179 @@
+/* atty - audio interface and driver for terminals
+ * Copyright (C) 2020 Øyvind Kolås <pippin@gimp.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* streaming polyphase resampler for interleaved 16bit stereo.
+ *
+ * A Kaiser windowed sinc of APC_RESAMPLE_TAPS taps is tabulated at
+ * APC_RESAMPLE_PHASES fractional positions, and output samples blend the
+ * two nearest phases. The cutoff follows the lower of the two rates so
+ * that downsampling does not alias. The input position advances by the
+ * exact ratio of the rates, so long streams do not drift.
+ *
+ * The channels are kept in separate histories, which lets the dot
+ * products run on 8 taps at a time with SSE2.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define APC_RESAMPLE_TAPS    64   /* a multiple of 8 */
+#define APC_RESAMPLE_PHASES  256
+#define APC_RESAMPLE_BLOCK   256  /* input frames per call at most */
+#define APC_RESAMPLE_SHIFT   14   /* coefficients are 2.14 fixed point */
+
+typedef struct ApcResample {
+  int      in_rate;
+  int      out_rate;
+  int      step;       // whole input frames per output frame
+  int      step_frac;  // and the remainder, in 1/out_rate
+  int      frac;       // position between input frames, in 1/out_rate
+  uint32_t frac_scale; // 2^32 / out_rate
+  int      hist_len;
+  int16_t  hist[2][APC_RESAMPLE_TAPS + APC_RESAMPLE_BLOCK];
+  int16_t  coeffs[APC_RESAMPLE_PHASES + 1][APC_RESAMPLE_TAPS];
+} ApcResample;
+
+static inline double apc_resample_i0 (double x)
+{
+  double sum = 1.0, term = 1.0;
+  for (int k = 1; k < 32; k++)
+  {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum  += term;
+  }
+  return sum;
+}
+
+static inline void apc_resample_init (ApcResample *r, int in_rate, int out_rate)
+{
+  const double beta = 6.0;  // about 60dB of stopband attenuation
+  double half   = APC_RESAMPLE_TAPS / 2;
+  double ratio  = out_rate < in_rate ? (double)out_rate / in_rate : 1.0;
+  /* the transition band ends at the nyquist frequency of the lower rate */
+  double cutoff = 0.5 * ratio - 3.6 / APC_RESAMPLE_TAPS * ratio / 2;
+
+  r->in_rate    = in_rate;
+  r->out_rate   = out_rate;
+  r->step       = in_rate / out_rate;
+  r->step_frac  = in_rate % out_rate;
+  r->frac       = 0;
+  r->frac_scale = ((uint64_t)1 << 32) / out_rate;
+  r->hist_len   = APC_RESAMPLE_TAPS / 2 - 1;
+  memset (r->hist, 0, sizeof (r->hist));
+
+  for (int p = 0; p <= APC_RESAMPLE_PHASES; p++)
+  {
+    double h[APC_RESAMPLE_TAPS];
+    double sum = 0.0;
+    for (int k = 0; k < APC_RESAMPLE_TAPS; k++)
+    {
+      double x = k - (half - 1) - (double)p / APC_RESAMPLE_PHASES;
+      double w = 1.0 - (x / half) * (x / half);
+      double s = x == 0.0 ? 1.0 : sin (2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+      h[k] = w > 0.0 ? s * apc_resample_i0 (beta * sqrt (w)) / apc_resample_i0 (beta) : 0.0;
+      sum += h[k];
+    }
+    for (int k = 0; k < APC_RESAMPLE_TAPS; k++)
+      r->coeffs[p][k] = lrint (h[k] / sum * (1 << APC_RESAMPLE_SHIFT));
+  }
+}
+
+/* forgets the history, for starting over on a new stream */
+static inline void apc_resample_reset (ApcResample *r)
+{
+  r->frac     = 0;
+  r->hist_len = APC_RESAMPLE_TAPS / 2 - 1;
+  memset (r->hist, 0, sizeof (r->hist));
+}
+
+/* upper bound for the frames produced from count input frames */
+static inline int apc_resample_max_out (ApcResample *r, int count)
+{
+  return (int)((int64_t)count * r->out_rate / r->in_rate) + 2;
+}
+
+static inline int32_t apc_resample_dot (const int16_t *x, const int16_t *h)
+{
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128 ();
+  for (int k = 0; k < APC_RESAMPLE_TAPS; k += 8)
+    acc = _mm_add_epi32 (acc, _mm_madd_epi16 (_mm_loadu_si128 ((const __m128i*)(x + k)),
+                                              _mm_loadu_si128 ((const __m128i*)(h + k))));
+  acc = _mm_add_epi32 (acc, _mm_shuffle_epi32 (acc, _MM_SHUFFLE (1, 0, 3, 2)));
+  acc = _mm_add_epi32 (acc, _mm_shuffle_epi32 (acc, _MM_SHUFFLE (2, 3, 0, 1)));
+  return _mm_cvtsi128_si32 (acc);
+#else
+  int32_t sum = 0;
+  for (int k = 0; k < APC_RESAMPLE_TAPS; k++)
+    sum += x[k] * h[k];
+  return sum;
+#endif
+}
+
+/* resamples count interleaved stereo frames, at most APC_RESAMPLE_BLOCK,
+ * dst needs room for apc_resample_max_out frames. Returns the number of
+ * frames written, the output lags the input by half the filter length.
+ */
+static inline int apc_resample_process (ApcResample *r, const int16_t *src,
+                                        int count, int16_t *dst)
+{
+  int pos = 0;
+  int out = 0;
+
+  for (int i = 0; i < count; i++)
+  {
+    r->hist[0][r->hist_len + i] = src[i * 2];
+    r->hist[1][r->hist_len + i] = src[i * 2 + 1];
+  }
+  r->hist_len += count;
+
+  while (pos + APC_RESAMPLE_TAPS <= r->hist_len)
+  {
+    uint32_t f     = r->frac * r->frac_scale;
+    int      phase = f >> 24;
+    int      blend = (f >> 8) & 0xffff;
+
+    for (int c = 0; c < 2; c++)
+    {
+      int32_t a = apc_resample_dot (r->hist[c] + pos, r->coeffs[phase]);
+      int32_t b = apc_resample_dot (r->hist[c] + pos, r->coeffs[phase + 1]);
+      int32_t v = a + (int32_t)(((int64_t)(b - a) * blend) >> 16);
+      v = (v + (1 << (APC_RESAMPLE_SHIFT - 1))) >> APC_RESAMPLE_SHIFT;
+      dst[out * 2 + c] = v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+    }
+    out++;
+
+    pos     += r->step;
+    r->frac += r->step_frac;
+    if (r->frac >= r->out_rate)
+    {
+      r->frac -= r->out_rate;
+      pos++;
+    }
+  }
+
+  if (pos > r->hist_len)
+    pos = r->hist_len;
+  for (int c = 0; c < 2; c++)
+    memmove (r->hist[c], r->hist[c] + pos, (r->hist_len - pos) * 2);
+  r->hist_len -= pos;
+  return out;
+}
@@ -0,0 +1,173 @@
+/* atty - audio interface and driver for terminals
+ * Copyright (C) 2020 Øyvind Kolås <pippin@gimp.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* block conversion between 16bit linear and G.711 ulaw.
+ *
+ * The encoder looks every sample up in a table covering all 65536 input
+ * values, built once from the reference encoder. The decoder expands
+ * ulaw into interleaved stereo. An SSSE3 kernel computes 16 samples at a
+ * time, looking the power of two of the exponent up with a byte shuffle,
+ * and a 256 entry table takes care of the rest of a block.
+ */
+#ifndef APC_ULAW_H
+#define APC_ULAW_H
+#include <stdint.h>
+
+#ifndef APC_ULAW_SIMD
+#if !defined(APC_ULAW_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define APC_ULAW_SIMD 1
+#else
+#define APC_ULAW_SIMD 0
+#endif
+#endif
+
+static uint8_t apc_ulaw_encode_table[65536];
+static int16_t apc_ulaw_decode_table[256];
+
+/* the reference encoder, with the bias and clip of G.711 */
+static inline uint8_t apc_linear_to_ulaw (int16_t sample)
+{
+  const int bias = 0x84;
+  const int clip = 32635;
+  int sign = (sample >> 8) & 0x80;
+  int val  = sample;
+  int exponent = 7;
+
+  if (sign)
+    val = -val;
+  if (val > clip)
+    val = clip;
+  val += bias;
+
+  while (exponent > 0 && !(val & (0x4000 >> (7 - exponent))))
+    exponent--;
+  return ~(sign | (exponent << 4) | ((val >> (exponent + 3)) & 0x0f));
+}
+
+static inline void apc_ulaw_init_tables (void)
+{
+  static int done = 0;
+  if (done)
+    return;
+  for (int i = 0; i < 65536; i++)
+    apc_ulaw_encode_table[i] = apc_linear_to_ulaw ((int16_t)i);
+  for (int i = 0; i < 256; i++)
+  {
+    int u = ~i & 0xff;
+    int t = (((u & 0x0f) << 3) + 0x84) << ((u & 0x70) >> 4);
+    apc_ulaw_decode_table[i] = (u & 0x80) ? 0x84 - t : t - 0x84;
+  }
+  done = 1;
+}
+
+/* encodes count samples */
+static inline void apc_ulaw_encode_block (const int16_t *src, int count,
+                                          uint8_t *dst)
+{
+  apc_ulaw_init_tables ();
+  for (int i = 0; i < count; i++)
+    dst[i] = apc_ulaw_encode_table[(uint16_t)src[i]];
+}
+
+#if APC_ULAW_SIMD
+#include <immintrin.h>
+
+static inline int apc_ulaw_simd_level (void)
+{
+  static int level = -1;
+  if (level < 0)
+  {
+    __builtin_cpu_init ();
+    level = __builtin_cpu_supports ("ssse3") ? 1 : 0;
+  }
+  return level;
+}
+
+/* decodes 8 ulaw codes held in the low bytes of the 16bit lanes */
+__attribute__((target("ssse3")))
+static inline __m128i apc_ulaw_decode8_ssse3 (__m128i u)
+{
+  const __m128i pow2 = _mm_setr_epi8 (1, 2, 4, 8, 16, 32, 64, -128,
+                                      0, 0, 0, 0, 0, 0, 0, 0);
+  __m128i exponent = _mm_and_si128 (_mm_srli_epi16 (u, 4), _mm_set1_epi16 (7));
+  /* the high bytes index 0x80, which shuffles in a 0 */
+  __m128i scale    = _mm_shuffle_epi8 (pow2, _mm_or_si128 (exponent, _mm_set1_epi16 ((short)0x8000)));
+  __m128i mantissa = _mm_slli_epi16 (_mm_and_si128 (u, _mm_set1_epi16 (0x0f)), 3);
+  __m128i t        = _mm_mullo_epi16 (_mm_add_epi16 (mantissa, _mm_set1_epi16 (0x84)), scale);
+  __m128i sign     = _mm_srai_epi16 (_mm_slli_epi16 (u, 8), 15);
+  __m128i mag      = _mm_sub_epi16 (t, _mm_set1_epi16 (0x84));
+  return _mm_sub_epi16 (_mm_xor_si128 (mag, sign), sign);
+}
+
+/* 16 codes at a time, returns the number of frames done */
+__attribute__((target("ssse3")))
+static inline int apc_ulaw_decode_ssse3 (const uint8_t *src, int frames,
+                                         int channels, int16_t *dst)
+{
+  const __m128i ones = _mm_set1_epi8 (-1);
+  int count = frames * channels;
+  int i;
+
+  for (i = 0; i + 16 <= count; i += 16)
+  {
+    __m128i in = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i*)(src + i)), ones);
+    __m128i lo = apc_ulaw_decode8_ssse3 (_mm_unpacklo_epi8 (in, _mm_setzero_si128 ()));
+    __m128i hi = apc_ulaw_decode8_ssse3 (_mm_unpackhi_epi8 (in, _mm_setzero_si128 ()));
+    if (channels == 2)
+    {
+      _mm_storeu_si128 ((__m128i*)(dst + i), lo);
+      _mm_storeu_si128 ((__m128i*)(dst + i + 8), hi);
+    }
+    else
+    {
+      _mm_storeu_si128 ((__m128i*)(dst + i * 2),      _mm_unpacklo_epi16 (lo, lo));
+      _mm_storeu_si128 ((__m128i*)(dst + i * 2 + 8),  _mm_unpackhi_epi16 (lo, lo));
+      _mm_storeu_si128 ((__m128i*)(dst + i * 2 + 16), _mm_unpacklo_epi16 (hi, hi));
+      _mm_storeu_si128 ((__m128i*)(dst + i * 2 + 24), _mm_unpackhi_epi16 (hi, hi));
+    }
+  }
+  return i / channels;
+}
+#endif
+
+/* decodes frames of mono or stereo ulaw into interleaved 16bit stereo */
+static inline void apc_ulaw_decode_block (const uint8_t *src, int frames,
+                                          int channels, int16_t *dst)
+{
+  int done = 0;
+
+  apc_ulaw_init_tables ();
+#if APC_ULAW_SIMD
+  if (apc_ulaw_simd_level () >= 1)
+    done = apc_ulaw_decode_ssse3 (src, frames, channels, dst);
+#endif
+  if (channels == 2)
+  {
+    for (int i = done; i < frames; i++)
+    {
+      dst[i * 2]     = apc_ulaw_decode_table[src[i * 2]];
+      dst[i * 2 + 1] = apc_ulaw_decode_table[src[i * 2 + 1]];
+    }
+  }
+  else
+  {
+    for (int i = done; i < frames; i++)
+      dst[i * 2] = dst[i * 2 + 1] = apc_ulaw_decode_table[src[i]];
+  }
+}
+#endif
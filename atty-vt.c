@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 
 #include <unistd.h>
 #include <assert.h>
@@ -22,6 +23,10 @@
 
 #include <termios.h>
 #include <pty.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <zlib.h>
 
 #ifndef MIN
 #define MIN(a,b) ((a)<(b)?(a):(b))
@@ -29,14 +34,25 @@
 
 #include "a85.h"
 #include "base64.h"
+#include "apc-opus.h"
+#include "apc-lossless.h"
+#include "apc-adpcm.h"
+#include "apc-dtx.h"
+#include "apc-resample.h"
+#include "apc-ulaw.h"
+#include "apc-pcm.h"
+#include "apc-frame.h"
 
-int has_data (int fd, int delay_ms);
 void atty_noraw (void);
 void atty_raw (void);
 
 static unsigned char buf[BUFSIZ];
 
 typedef struct AudioState {
+  struct AudioState *current; // state of the i= stream of the packet
+  struct PcmRing    *ring;    // where decoded frames are queued
+  struct VtAudioSample *upload; // or collected, for a=u
+
   int action;
   int samplerate; // 8000
   int channels;   // 1
@@ -48,13 +64,85 @@ typedef struct AudioState {
                   //    and if gotten, start streaming
                   //    audio packets in the incoming direction
   int encoding;   // 'a' ascci85 'b' base64
-  int compression; // z zlib o opus
-  int buffer_size;
+  int compression; // z zlib, Z zlib stream spanning packets, l lossless,
+                   // i ima adpcm, o opus
+  int buffer_size; // frames queued ahead of the device, the latency target
+  int pull;        // 1 the SDL audio thread pulls from the pcm ring
+  int dtx;         // level below which mic packets are replaced by a=s
+  ApcDtx dtx_state;
+  int noise;       // n= level of an a=s gap
+  uint32_t noise_seed;
+
+  /* k=1 credit based flow control, the playback position is reported
+   * relative to the ring write position at the time of the request
+   */
+  int          credit;
+  unsigned int credit_base;
+  unsigned int credit_played;
+
+  int          paused;     // a=h holds output until a=r
+  unsigned int dropped;    // frames discarded by a=f, not played
+
+  int          idle_ms;    // W= idle time before the speaker closes, 0 never
+  long long    arrival_us; // when audio arrived for an idle device
+  int          latency_us; // from arrival to the device, of the last onset
+  int          latency_max_us;
+
+  ApcResample  resample;   // s= to the device rate
+  ApcResample *upload_resample; // the same for a=u, apart from the stream's
 
   int frames;
 
-  uint8_t *data;
-  int      data_size;
+  /* state of the transfer payload being decoded as it arrives */
+  int       streaming;
+  int       frames_left;   // -1 when no frame count was given
+  A85Dec    a85;
+  Base64Dec b64;
+  int       y_escape;
+  int       inflating;
+  z_stream *inflate;
+  int       inflate_fresh; // o=Z seen, restart the inflate stream
+
+  /* mic direction o=Z state, the stream restarts when the mic opens */
+  z_stream *deflate;
+  int       deflate_fresh;
+
+  /* mic packets are compressed into mic_z and framed in mic_packet, these
+   * grow to the largest packet sent
+   */
+  uint8_t  *mic_z;
+  int       mic_z_cap;
+  char     *mic_packet;
+  int       mic_packet_cap;
+
+#ifdef HAVE_OPUS
+  /* o=o decoder for the payload and encoder for the mic direction, both
+   * kept for as long as the samplerate and channels stay the same
+   */
+  OpusDecoder  *opus_dec;
+  int           opus_dec_samplerate;
+  int           opus_dec_channels;
+  ApcOpusUnpack opus_unpack;
+  OpusEncoder  *opus_enc;
+  int           opus_enc_samplerate;
+  int           opus_enc_channels;
+  int16_t       opus_pcm[2880 * 2];  // mic frames waiting for a full opus frame
+  int           opus_pcm_frames;
+#endif
+  uint8_t   frame_buf[16]; // partial frame carried between pieces
+  int       frame_buf_len;
+
+  /* o=l decodes whole packets, these grow to the largest packet seen */
+  uint8_t  *block;
+  int       block_len;
+  int       block_cap;
+  uint8_t  *block_pcm;
+  int       block_pcm_cap;
+
+  ApcAdpcm  adpcm;           // o=i decoder state
+  uint8_t   adpcm_header[APC_ADPCM_HEADER * 2];
+  int       adpcm_header_len;
+  ApcAdpcm  adpcm_enc;       // o=i mic encoder state
 } AudioState;
 
 typedef struct VtPty {
@@ -75,12 +163,14 @@ struct _VT {
   int       argument_buf_cap;
   ssize_t (*write)(void *serial_obj, const void *buf, size_t count);
   ssize_t (*read)(void *serial_obj, void *buf, size_t count);
-  int     (*waitdata)(void *serial_obj, int timeout);
   void    (*resize)(void *serial_obj, int cols, int rows, int px_width, int px_height);
 
   VtPty      vtpty;
+  int        stdin_closed;
 
   AudioState audio;
+  int        audio_timer;    // timerfd driving vt_audio_task
+  int        audio_interval; // ms the timer is armed for, 0 when idle
 };
 
 static ssize_t vt_write (VT *vt, const void *buf, size_t count)
@@ -93,11 +183,6 @@ static ssize_t vt_read (VT *vt, void *buf, size_t count)
   if (!vt->read) return 0;
   return vt->read (&vt->vtpty, buf, count);
 }
-static int vt_waitdata (VT *vt, int timeout)
-{
-  if (!vt->waitdata) return 0;
-  return vt->waitdata (&vt->vtpty, timeout);
-}
 
 /* NOTE : the reason the source is split the way it is, is that the
  *        audio-engine originates in another project
@@ -162,6 +247,7 @@ static void vt_state_esc          (VT *vt, int byte);
 static void vt_state_osc          (VT *vt, int byte);
 static void vt_state_apc          (VT *vt, int byte);
 static void vt_state_apc_generic  (VT *vt, int byte);
+static void vt_state_apc_audio_payload (VT *vt, int byte);
 static void vt_state_esc_sequence (VT *vt, int byte);
 static void vt_state_esc_foo      (VT *vt, int byte);
 static void vt_state_swallow      (VT *vt, int byte);
@@ -190,30 +276,6 @@ static ssize_t vtpty_read (void  *data, void *buf, size_t count)
   return read (vtpty->pty, buf, count);
 }
 
-static int vtpty_waitdata (void  *data, int timeout)
-{
-  VtPty *vtpty = data;
-  struct timeval tv;
-  fd_set fdset;
-  FD_ZERO (&fdset);
-  FD_SET(vtpty->pty, &fdset);
-
-  tv.tv_sec = 0;
-  tv.tv_usec = timeout;
-  tv.tv_sec  = timeout / 1000000;
-  tv.tv_usec = timeout % 1000000;
-
-  if (select (vtpty->pty+1, &fdset, NULL, NULL, &tv) == -1){
-    perror("select");
-    return 0;
-  }
-  if (FD_ISSET(vtpty->pty, &fdset))
-  {
-    return 1;
-  }
-  return 0;
-}
-
 static void vt_resize (int sig)
 {
   struct winsize ws;
@@ -258,6 +320,8 @@ static void vtcmd_reset_to_initial_state (VT *vt, const char *sequence)
   vt->audio.type        = 'u';
   vt->audio.samplerate  = 8000;
   vt->audio.encoding    = 'a';
+  vt->audio.ring        = &pcm_queue;
+  vt->audio.idle_ms     = 60000;
   vt->audio.compression = '0';
   vt->audio.mic         = 0;
 }
@@ -267,7 +331,6 @@ VT *vt_new (const char *command, int cols, int rows, float font_size, float line
 {
   VT *vt         = calloc (sizeof (VT), 1);
   vt->state         = vt_state_neutral;
-  vt->waitdata      = vtpty_waitdata;
   vt->read          = vtpty_read;
   vt->write         = vtpty_write;
   vt->resize        = vtpty_resize;
@@ -278,6 +341,8 @@ VT *vt_new (const char *command, int cols, int rows, float font_size, float line
   vt->argument_buf       = malloc (vt->argument_buf_cap);
   vt->argument_buf[0]    = 0;
 
+  vt->audio_timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+
   if (command)
   {
     vt_run_command (vt, command);
@@ -293,34 +358,134 @@ VT *vt_new (const char *command, int cols, int rows, float font_size, float line
   return vt;
 }
 
+/* write a span of ordinary output straight to the terminal, flushing
+ * whatever the escape sequence handlers left in stdio first to keep ordering
+ */
+static void vt_passthrough (const uint8_t *data, int len)
+{
+  fflush (stdout);
+  while (len > 0)
+  {
+    ssize_t written = write (STDOUT_FILENO, data, len);
+    if (written < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return;
+    }
+    data += written;
+    len  -= written;
+  }
+}
+
+/* feed a block of pty output through the state machine, in the neutral
+ * state everything up to the next ESC is passed through verbatim, only
+ * escape sequences are parsed byte by byte.
+ */
+static void vt_feed (VT *vt, const uint8_t *data, int len)
+{
+  int i = 0;
+  while (i < len)
+  {
+    if (vt->state == vt_state_neutral)
+    {
+      const uint8_t *esc = memchr (data + i, 27, len - i);
+      int span = esc ? esc - (data + i) : len - i;
+      if (span)
+      {
+        vt_passthrough (data + i, span);
+        i += span;
+        continue;
+      }
+    }
+    else if (vt->state == vt_state_apc_audio_payload)
+    {
+      int span = 0;
+      while (i + span < len &&
+             (data[i + span] >= 32 ||
+              (data[i + span] >= 8 && data[i + span] <= 13)))
+        span++;
+      if (span)
+      {
+        vt_audio_stream (vt, data + i, span);
+        i += span;
+        continue;
+      }
+    }
+    vt->state (vt, data[i++]);
+  }
+}
+
+/* (re)arm the audio timerfd to fire every interval ms, 0 disarms it */
+static void vt_audio_timer_arm (VT *vt, int interval)
+{
+  struct itimerspec its = {{0,0},{0,0}};
+  if (vt->audio_timer < 0 || interval == vt->audio_interval)
+    return;
+  its.it_interval.tv_sec  = interval / 1000;
+  its.it_interval.tv_nsec = (interval % 1000) * 1000000;
+  its.it_value = its.it_interval;
+  timerfd_settime (vt->audio_timer, 0, &its, NULL);
+  vt->audio_interval = interval;
+}
+
+/* wait for and dispatch one round of events, keystrokes on stdin, output
+ * from the pty and audio refill deadlines from the timerfd, timeout is the
+ * maximum time to wait in ms.
+ */
 int vt_poll (VT *vt, int timeout)
 {
-  int read_size = sizeof(buf);
+  struct pollfd fds[3];
   int got_data = 0;
-  int remaining_chars = 1024 * 1024;
-  int len = 0;
-  vt_audio_task (vt, 0);
+  int nfds = 0;
 
-  while (has_data (STDIN_FILENO, 10))
+  fds[0].fd = vt->stdin_closed ? -1 : STDIN_FILENO;
+  fds[0].events = POLLIN;
+  fds[1].fd = vt->vtpty.pty;
+  fds[1].events = POLLIN;
+  fds[2].fd = vt->audio_timer;
+  fds[2].events = POLLIN;
+  nfds = vt->audio_timer >= 0 ? 3 : 2;
+
+  if (poll (fds, nfds, timeout) < 0)
   {
-    uint8_t c;
-    read (STDIN_FILENO, &c, (size_t)1);
-    vt_write (vt, &c, 1);
+    if (errno != EINTR)
+      perror ("poll");
+    return 0;
   }
 
-  read_size = MIN(read_size, remaining_chars);
-  while (timeout > 100 &&
-         remaining_chars > 0 &&
-         vt_waitdata (vt, timeout))
+  if (fds[0].revents)
   {
-    len = vt_read (vt, buf, read_size);
-    for (int i = 0; i < len; i++)
-      vt->state (vt, buf[i]);
-    got_data+=len;
-    remaining_chars -= len;
-    timeout -= 10;
-    vt_audio_task (vt, 0);
+    uint8_t keys[256];
+    ssize_t len = read (STDIN_FILENO, keys, sizeof (keys));
+    if (len > 0)
+      vt_write (vt, keys, len);
+    else if (len == 0 || (errno != EINTR && errno != EAGAIN))
+      vt->stdin_closed = 1;
+  }
+
+  if (fds[1].revents)
+  {
+    ssize_t len = vt_read (vt, buf, sizeof (buf));
+    if (len > 0)
+    {
+      vt_feed (vt, buf, len);
+      got_data += len;
+    }
+    else if (len == 0 || (errno != EINTR && errno != EAGAIN))
+      do_quit = 1;
   }
+
+  if (nfds > 2 && fds[2].revents)
+  {
+    uint64_t expirations;
+    read (vt->audio_timer, &expirations, sizeof (expirations));
+  }
+
+  if (got_data || (nfds > 2 && fds[2].revents))
+    vt_audio_task (vt, 0);
+  vt_audio_timer_arm (vt, vt_audio_interval (vt));
+
   fflush (NULL);
   return got_data;
 }
@@ -329,6 +494,11 @@ void vt_destroy (VT *vt)
 {
   free (vt->argument_buf);
 
+  vt_audio_streams_reclaim (&vt->audio, 1);
+  vt_audio_free (&vt->audio);
+  vt_audio_samples_free ();
+  if (vt->audio_timer >= 0)
+    close (vt->audio_timer);
   kill (vt->vtpty.pid, 9);
   close (vt->vtpty.pty);
   free (vt);
@@ -389,14 +559,40 @@ static void vt_state_swallow (VT *vt, int byte)
 }
 static void ensure_title (VT *vt);
 
+/* the payload of an audio APC, handed to the audio decoder as it arrives
+ * rather than collected, vt_feed passes whole spans of it at once
+ */
+static void vt_state_apc_audio_payload (VT *vt, int byte)
+{
+  if ((byte < 32) && ( (byte < 8) || (byte > 13)) )
+  {
+    vt_audio_stream_end (vt);
+    vt->state = ((byte == 27) ?  vt_state_swallow : vt_state_neutral);
+  }
+  else
+  {
+    uint8_t c = byte;
+    vt_audio_stream (vt, &c, 1);
+  }
+}
+
+/* the key=value header of an audio APC, up to the ';' */
 static void vt_state_apc_audio (VT *vt, int byte)
 {
   if ((byte < 32) && ( (byte < 8) || (byte > 13)) )
   {
     vt_audio (vt, vt->argument_buf);
+    vt_audio_stream_end (vt);
     ensure_title (vt);
     vt->state = ((byte == 27) ?  vt_state_swallow : vt_state_neutral);
   }
+  else if (byte == ';')
+  {
+    vt_argument_buf_add (vt, byte);
+    vt_audio (vt, vt->argument_buf);
+    ensure_title (vt);
+    vt->state = vt_state_apc_audio_payload;
+  }
   else
   {
     vt_argument_buf_add (vt, byte);
@@ -28,13 +28,21 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <termios.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <zlib.h>
 
 #include "a85.h"
 #include "base64.h"
+#include "apc-opus.h"
+#include "apc-lossless.h"
+#include "apc-adpcm.h"
+#include "apc-dtx.h"
+#include "apc-frame.h"
 
 #ifndef MIN
 #define MIN(a,b) ((a)<(b)?(a):(b))
@@ -45,7 +53,6 @@ static int    nc_is_raw = 0;
 int atty_vt (int argc, char **argv);
 
 int tty_fd = STDIN_FILENO;
-static unsigned char buf[BUFSIZ];
 
 void atty_noraw (void)
 {
@@ -69,9 +76,26 @@ at_exit_mic (void)
   usleep (1000 * 100);
 }
 
+#define CREDIT_TIMEOUT_MS 2000  /* without acks for this long credits are dropped */
+
+static int          credit_window = 0; // w= of the last k= ack, 0 without credits
+static unsigned int credit_played = 0; // P= of the last k= ack
+
 static void
 at_exit_speaker (void)
 {
+  if (credit_window)
+  {
+    fprintf (stdout, "\033_Ak=0;\033\\");
+    fflush (stdout);
+    while (has_data (tty_fd, 100))
+    {
+      char c;
+      if (read (tty_fd, &c, (size_t)1) != 1)
+        break;
+    }
+    credit_window = 0;
+  }
   atty_noraw();
   fflush (NULL);
 }
@@ -125,6 +149,8 @@ int ulaw = 1;
 int compression = '0';
 int encoding = '0';
 int type = 'u';
+int pull = 0;
+int dtx = 0;
 int lost_time = 0;
 int lost_start;
 int lost_end;
@@ -135,6 +161,7 @@ enum {
   ACTION_SPEAKER,
   ACTION_MIC,
   ACTION_ENGINE,
+  ACTION_POSITION,
 };
 
 int action = ACTION_STATUS;
@@ -162,6 +189,9 @@ const char *terminal_response(void)
   while (has_data (tty_fd, 500) && len < BUFSIZ - 2)
   {
     read (tty_fd, &buf[len++], (size_t)1);
+    /* done at the end of the APC reply */
+    if (len >= 2 && buf[len-2] == '\033' && buf[len-1] == '\\')
+      break;
   }
   if (len > 0)
   buf[--len] = 0;
@@ -219,6 +249,14 @@ int atty_readconfig (void)
     {
       compression = strstr (ret, "o=")[2];
     }
+    if (strstr (ret, "p="))
+    {
+      pull = atoi (strstr (ret, "p=")+2);
+    }
+    if (strstr (ret, "d="))
+    {
+      dtx = atoi (strstr (ret, "d=")+2);
+    }
   }
   else
   {
@@ -238,6 +276,8 @@ void atty_status (void)
   fprintf (stdout, "channels=%i\n", channels);
   fprintf (stdout, "bits=%i\n", bits);
   fprintf (stdout, "buffer_size=%i\n", buffer_size);
+  fprintf (stdout, "pull=%i\n", pull);
+  fprintf (stdout, "dtx=%i\n", dtx);
 
   switch (type)
   {
@@ -278,6 +318,15 @@ void atty_status (void)
     case 'z':
         fprintf (stdout, "compression=z\n");
         break;
+    case 'Z':
+        fprintf (stdout, "compression=Z\n");
+        break;
+    case 'l':
+        fprintf (stdout, "compression=lossless\n");
+        break;
+    case 'i':
+        fprintf (stdout, "compression=adpcm\n");
+        break;
     case 'o':
         fprintf (stdout, "compression=opus\n");
         break;
@@ -288,6 +337,55 @@ void atty_status (void)
 void atty_mic (void);
 void atty_speaker (void);
 
+/* queries the playback position, for scripts doing A/V sync */
+static int atty_position (void)
+{
+  const char *ret;
+  unsigned int played = 0;
+  int queued = 0, device_queued = 0, rate = 8000;
+  long long time_us = 0;
+  int onset_us = 0, onset_max_us = 0;
+
+  if (atty_raw ())
+  {
+    fprintf (stdout, "nc raw failed\n");
+  }
+  printf ("\033_Aa=p;\033\\");
+  ret = terminal_response ();
+  atty_noraw ();
+
+  if (!strstr (ret, "a=p,"))
+  {
+    fprintf (stderr, "no position reply from terminal\n");
+    return -1;
+  }
+  if (strstr (ret, "P="))
+    played = strtoul (strstr (ret, "P=")+2, NULL, 10);
+  if (strstr (ret, "q="))
+    queued = atoi (strstr (ret, "q=")+2);
+  if (strstr (ret, "Q="))
+    device_queued = atoi (strstr (ret, "Q=")+2);
+  if (strstr (ret, "s="))
+    rate = atoi (strstr (ret, "s=")+2);
+  if (strstr (ret, "t="))
+    time_us = atoll (strstr (ret, "t=")+2);
+  if (strstr (ret, "l="))
+    onset_us = atoi (strstr (ret, "l=")+2);
+  if (strstr (ret, "L="))
+    onset_max_us = atoi (strstr (ret, "L=")+2);
+
+  fprintf (stdout, "played=%u\n", played);
+  fprintf (stdout, "queued=%i\n", queued);
+  fprintf (stdout, "device_queued=%i\n", device_queued);
+  fprintf (stdout, "latency_ms=%i\n",
+           rate ? (int)((queued + device_queued) * 1000LL / rate) : 0);
+  fprintf (stdout, "time_us=%lld\n", time_us);
+  fprintf (stdout, "onset_latency_us=%i\n", onset_us);
+  fprintf (stdout, "onset_latency_max_us=%i\n", onset_max_us);
+  fflush (NULL);
+  return 0;
+}
+
 
 int main (int argc, char **argv)
 {
@@ -319,6 +417,16 @@ int main (int argc, char **argv)
         sprintf (&config[strlen(config)],
                  "%sB=%i", config[0]?",":"", atoi(value));
       }
+      else if (!strcmp (key, "pull") ||  !strcmp (key, "p"))
+      {
+        sprintf (&config[strlen(config)],
+                 "%sp=%i", config[0]?",":"", atoi(value));
+      }
+      else if (!strcmp (key, "dtx") ||  !strcmp (key, "d"))
+      {
+        sprintf (&config[strlen(config)],
+                 "%sd=%i", config[0]?",":"", atoi(value));
+      }
       else if (!strcmp (key, "channels") ||  !strcmp (key, "c"))
       {
         sprintf (&config[strlen(config)],
@@ -371,6 +479,21 @@ int main (int argc, char **argv)
         {
           sprintf (&config[strlen(config)], "%so=z", config[0]?",":"");
         }
+        else if (!strcmp (value, "deflate-stream")||
+                 !strcmp (value, "Z"))
+        {
+          sprintf (&config[strlen(config)], "%so=Z", config[0]?",":"");
+        }
+        else if (!strcmp (value, "lossless")||
+                 !strcmp (value, "l"))
+        {
+          sprintf (&config[strlen(config)], "%so=l", config[0]?",":"");
+        }
+        else if (!strcmp (value, "adpcm")||
+                 !strcmp (value, "i"))
+        {
+          sprintf (&config[strlen(config)], "%so=i", config[0]?",":"");
+        }
         else
         {
           sprintf (&config[strlen(config)], "%so=0", config[0]?",":"");
@@ -400,10 +523,14 @@ int main (int argc, char **argv)
       {
         action = ACTION_SPEAKER;
       }
+      else if (!strcmp (argv[i], "position"))
+      {
+        action = ACTION_POSITION;
+      }
       else if (!strcmp (argv[i], "--help"))
       {
         atty_noraw();
-        printf ("Usage: atty [mic|speaker] key1=value key2=value\n");
+        printf ("Usage: atty [mic|speaker|position] key1=value key2=value\n");
         printf ("\n");
         printf ("Run atty alone to activate - or show status\n");
         return 0;
@@ -438,6 +565,8 @@ int main (int argc, char **argv)
       atty_readconfig ();
       atty_mic ();
       break;
+    case ACTION_POSITION:
+      return atty_position () ? 1 : 0;
   }
 
   return 0;
@@ -445,95 +574,455 @@ int main (int argc, char **argv)
 
 /////////
 
+/* runs the wall-clock pacing bookkeeping, called once per emitted packet
+ * rather than once per byte, sleeping when we are more than two buffers
+ * ahead of the terminal.
+ */
+static void atty_speaker_pace (int byte_rate)
+{
+  lost_end = atty_ticks();
+  lost_time += (lost_end - lost_start);
+  buffered_bytes -= (byte_rate * lost_time / 1000);
+  lost_time = 0;
+
+  if (buffered_bytes < 0)
+    buffered_bytes = 0;
+
+  if (buffered_bytes > buffer_size * 2)
+  {
+    int wait_bytes = buffered_bytes - buffer_size * 2;
+    usleep (wait_bytes * 1000 * 1000 / byte_rate);
+    buffered_bytes = buffer_size * 2;
+  }
+  lost_start = atty_ticks ();
+}
+
+/* reads the k= acknowledgements the terminal has sent, waiting up to
+ * timeout_ms for the first, returns 1 if any arrived. Other input on the
+ * terminal is discarded.
+ */
+static int atty_speaker_acks (int timeout_ms)
+{
+  static char buf[128];
+  static int  len = 0;
+  int got = 0;
+
+  while (has_data (tty_fd, got ? 0 : timeout_ms))
+  {
+    char c;
+    if (read (tty_fd, &c, (size_t)1) != 1)
+      break;
+    if (c == '\033' && len == 0)
+    {
+      buf[len++] = c;
+    }
+    else if (len > 0 && len < (int)sizeof (buf) - 1)
+    {
+      buf[len++] = c;
+      if (c == '\\' && buf[len-2] == '\033')
+      {
+        buf[len] = 0;
+        if (!strncmp (buf, "\033_Ak=1", 6) && strstr (buf, "w="))
+        {
+          if (strstr (buf, "P="))
+            credit_played = strtoul (strstr (buf, "P=")+2, NULL, 10);
+          credit_window = atoi (strstr (buf, "w=")+2);
+          got = 1;
+        }
+        len = 0;
+      }
+    }
+    else
+    {
+      len = 0;
+    }
+  }
+  return got;
+}
+
+/* asks the terminal for credit based flow control, without an answer we
+ * fall back to wall-clock pacing
+ */
+static int atty_speaker_credit_start (void)
+{
+  if (atty_raw ())
+    return 0;
+  fprintf (stdout, "\033_Ak=1;\033\\");
+  fflush (stdout);
+  credit_window = 0;
+  atty_speaker_acks (500);
+  if (!credit_window)
+    atty_noraw ();
+  return credit_window != 0;
+}
+
+/* atty speaker runs as a pipeline, so that compressing a packet never
+ * delays sending the previous one. A reader thread fills blocks from
+ * stdin, the main thread encodes them into complete APC packets ahead of
+ * time, and a writer thread paces the packets out to the terminal. The
+ * stages hand slots of fixed arrays to each other through bounded single
+ * producer, single consumer queues.
+ */
+#define SPEAKER_SLOTS 4  /* a power of two */
+
+typedef struct AttyQueue {
+  atomic_uint write_pos;
+  atomic_uint read_pos;
+} AttyQueue;
+
+/* the slot to fill next, waits while all slots are in use */
+static int atty_queue_reserve (AttyQueue *q)
+{
+  unsigned int pos = atomic_load_explicit (&q->write_pos, memory_order_relaxed);
+  while (pos - atomic_load_explicit (&q->read_pos, memory_order_acquire) >= SPEAKER_SLOTS)
+    usleep (500);
+  return pos % SPEAKER_SLOTS;
+}
+
+static void atty_queue_push (AttyQueue *q)
+{
+  atomic_fetch_add_explicit (&q->write_pos, 1, memory_order_release);
+}
+
+/* the slot to consume next, waits while the queue is empty */
+static int atty_queue_peek (AttyQueue *q)
+{
+  unsigned int pos = atomic_load_explicit (&q->read_pos, memory_order_relaxed);
+  while (atomic_load_explicit (&q->write_pos, memory_order_acquire) == pos)
+    usleep (500);
+  return pos % SPEAKER_SLOTS;
+}
+
+static void atty_queue_pop (AttyQueue *q)
+{
+  atomic_fetch_add_explicit (&q->read_pos, 1, memory_order_release);
+}
+
+typedef struct SpeakerBlock {
+  int     len;   // bytes of whole frames, 0 at the end of the stream
+  uint8_t pcm[4096 * 4];
+} SpeakerBlock;
+
+typedef struct SpeakerPacket {
+  int     frames; // frames the packet accounts for, for pacing
+  int     len;    // bytes from start, 0 at the end of the stream
+  char   *start;
+  char    data[APC_FRAME_HEADROOM + 4096 * 8];
+} SpeakerPacket;
+
+static SpeakerBlock  speaker_blocks[SPEAKER_SLOTS];
+static SpeakerPacket speaker_packets[SPEAKER_SLOTS];
+static AttyQueue     speaker_block_queue;
+static AttyQueue     speaker_packet_queue;
+static int           speaker_frame_bytes;
+static int           speaker_packet_bytes;
+
+/* reads whole packets at a time, a short read only happens at the end of
+ * the stream, where we send what we got truncated to whole frames.
+ */
+static void *atty_speaker_reader (void *data)
+{
+  for (;;)
+  {
+    SpeakerBlock *block = &speaker_blocks[atty_queue_reserve (&speaker_block_queue)];
+    int len = fread (block->pcm, 1, speaker_packet_bytes, stdin);
+    block->len = len > 0 ? len - len % speaker_frame_bytes : 0;
+    atty_queue_push (&speaker_block_queue);
+    if (block->len == 0)
+      break;
+  }
+  return NULL;
+}
+
+/* writes all of len bytes, returns -1 on errors */
+static int atty_write (int fd, const char *buf, int len)
+{
+  while (len > 0)
+  {
+    ssize_t written = write (fd, buf, len);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    buf += written;
+    len -= written;
+  }
+  return 0;
+}
+
+/* sends the encoded packets, paced by the terminal or the wall-clock */
+static void *atty_speaker_writer (void *data)
+{
+  int byte_rate = sample_rate * speaker_frame_bytes;
+  unsigned int sent = 0;
+
+  for (;;)
+  {
+    SpeakerPacket *packet = &speaker_packets[atty_queue_peek (&speaker_packet_queue)];
+
+    if (packet->len == 0)
+      break;
+
+    if (credit_window)
+    {
+      /* send only what the terminal has room for, it reports how far
+       * playback has come
+       */
+      atty_speaker_acks (0);
+      while (credit_window && (int)(sent - credit_played) > 0 &&
+             (int)(sent - credit_played) + packet->frames > credit_window)
+      {
+        /* a terminal that stops answering is paced by the wall-clock */
+        if (!atty_speaker_acks (CREDIT_TIMEOUT_MS))
+        {
+          atty_write (STDOUT_FILENO, "\033_Ak=0;\033\\", 9);
+          credit_window = 0;
+          lost_start = atty_ticks ();
+        }
+      }
+      sent += packet->frames;
+    }
+    if (!credit_window)
+    {
+      atty_speaker_pace (byte_rate);
+    }
+
+    atty_write (STDOUT_FILENO, packet->start, packet->len);
+    buffered_bytes += packet->frames * speaker_frame_bytes;
+    atty_queue_pop (&speaker_packet_queue);
+  }
+  return NULL;
+}
+
 void atty_speaker (void)
 {
-  uint8_t audio_packet[4096 * 4];
-  uint8_t audio_packet_z[4096 * 4];
-  uint8_t audio_packet_a85[4096 * 8];
+  uint8_t audio_packet_z[4096 * 5];
   uint8_t *data = NULL;
   int  len = 0;
+  z_stream deflate_stream = {0,};
+  ApcAdpcm adpcm = {{0, 0}, {0, 0}};
+  ApcDtx   dtx_state = {0};
+  const char *restart = "";
+  pthread_t reader, writer;
+#ifdef HAVE_OPUS
+  OpusEncoder *opus_enc = NULL;
+  int opus_frames = 0;
+#endif
+
+  int frame_bytes = bits/8 * channels;
+  int packet_bytes = buffer_size;
 
-  int byte_rate = sample_rate * bits/8 * channels;
+  if (packet_bytes > (int)sizeof (speaker_blocks[0].pcm))
+    packet_bytes = sizeof (speaker_blocks[0].pcm);
+  packet_bytes -= packet_bytes % frame_bytes;
+  if (packet_bytes <= 0)
+    packet_bytes = frame_bytes;
 
   signal (SIGINT, signal_int_speaker);
   signal (SIGTERM, signal_int_speaker);
   atexit (at_exit_speaker);
 
-  lost_start = atty_ticks ();
+  if (compression == 'Z')
+  {
+    deflateInit (&deflate_stream, Z_DEFAULT_COMPRESSION);
+    restart = ",o=Z";
+  }
+  else if (compression == 'i' && bits != 16)
+  {
+    fprintf (stderr, "adpcm needs 16bit samples\n");
+    return;
+  }
+  else if (compression == 'o')
+  {
+#ifdef HAVE_OPUS
+    /* packets are whole opus frames, as many as fit in the packet size
+     * and the worst case encoded size
+     */
+    int error;
+    int count;
+    if (bits != 16)
+    {
+      fprintf (stderr, "opus needs 16bit samples\n");
+      return;
+    }
+    opus_frames = apc_opus_frame_size (sample_rate, buffer_size);
+    count = packet_bytes / frame_bytes / opus_frames;
+    count = MIN (count, (int)sizeof (audio_packet_z) / (APC_OPUS_PACKET_MAX + 2));
+    if (count < 1)
+      count = 1;
+    packet_bytes = count * opus_frames * frame_bytes;
+    opus_enc = opus_encoder_create (sample_rate, channels,
+                                    OPUS_APPLICATION_AUDIO, &error);
+    if (!opus_enc)
+      return;
+#else
+    fprintf (stderr, "built without opus support\n");
+    return;
+#endif
+  }
 
-  while (fread (buf, 1, 1, stdin) == 1)
+  if (encoding != 'a' && encoding != 'b')
   {
-    audio_packet[len++]=buf[0];
+    // we need a text encoding
+    return;
+  }
 
-    lost_end = atty_ticks();
-    lost_time += (lost_end - lost_start);
-    buffered_bytes -= (byte_rate * lost_time / 1000);
-    lost_time = 0;
+  lost_start = atty_ticks ();
+  atty_speaker_credit_start ();
+
+  speaker_frame_bytes  = frame_bytes;
+  speaker_packet_bytes = packet_bytes;
+  /* the reader can be blocked on stdin when we are done, it is not
+   * waited for
+   */
+  if (pthread_create (&reader, NULL, atty_speaker_reader, NULL) != 0 ||
+      pthread_create (&writer, NULL, atty_speaker_writer, NULL) != 0)
+  {
+    fprintf (stderr, "failed to start threads\n");
+    return;
+  }
+  pthread_detach (reader);
 
-    if (buffered_bytes < 0)
-      buffered_bytes = 0;
+  for (;;)
+  {
+    SpeakerBlock  *block  = &speaker_blocks[atty_queue_peek (&speaker_block_queue)];
+    SpeakerPacket *packet = &speaker_packets[atty_queue_reserve (&speaker_packet_queue)];
+    uint8_t *audio_packet = block->pcm;
+
+    len = block->len;
+    packet->frames = len / frame_bytes;
+    packet->len    = 0;
+    if (len == 0)
+      break;
 
-    if (buffered_bytes > buffer_size * 2)
+    if (dtx)
     {
-      int wait_bytes = buffered_bytes - buffer_size * 2;
-      usleep (wait_bytes * 1000 * 1000 / byte_rate);
-      buffered_bytes = buffer_size * 2;
+      int level = apc_dtx_level (audio_packet, len / frame_bytes, channels,
+                                 type, bits);
+      if (apc_dtx_quiet (&dtx_state, dtx, level))
+      {
+        packet->start = packet->data;
+        packet->len   = apc_dtx_message (packet->data, len / frame_bytes, level);
+        atty_queue_pop (&speaker_block_queue);
+        atty_queue_push (&speaker_packet_queue);
+        continue;
+      }
     }
-    lost_start = atty_ticks ();
 
-    if (len >= buffer_size)
-    {
-      uLongf encoded_len = sizeof (audio_packet_z);
-      data = audio_packet;
-      int data_len = encoded_len;
+    uLongf encoded_len = len;
+    data = audio_packet;
 
-      if (compression == 'z')
+    if (compression == 'z')
+    {
+      encoded_len = sizeof (audio_packet_z);
+      int z_result = compress (audio_packet_z, &encoded_len,
+                               data, len);
+      if (z_result != Z_OK)
       {
-        int z_result = compress (audio_packet_z, &encoded_len,
-                                 data, encoded_len);
-        if (z_result != Z_OK)
-        {
-          printf ("\e_Ao=z;zlib error-\e\\");
-          continue;
-        }
-        else
-        {
-          data = audio_packet_z;
-        }
-        data_len = encoded_len;
+        packet->frames = 0;
+        packet->start  = packet->data;
+        packet->len    = sprintf (packet->data, "\e_Ao=z;zlib error-\e\\");
+        atty_queue_pop (&speaker_block_queue);
+        atty_queue_push (&speaker_packet_queue);
+        continue;
       }
-
-      if (encoding == 'a')
+      else
       {
-        int new_len = a85enc (data, (char*)audio_packet_a85, encoded_len);
-        audio_packet_a85[new_len]=0;
-        data = audio_packet_a85;
-        data_len = new_len;
+        data = audio_packet_z;
       }
-      else if (encoding == 'b')
+    }
+    else if (compression == 'Z')
+    {
+      /* the deflate window spans the session, a sync flush per packet
+       * lets the terminal decode each packet as it arrives
+       */
+      deflate_stream.next_in   = data;
+      deflate_stream.avail_in  = len;
+      deflate_stream.next_out  = audio_packet_z;
+      deflate_stream.avail_out = sizeof (audio_packet_z);
+      if (deflate (&deflate_stream, Z_SYNC_FLUSH) != Z_OK ||
+          deflate_stream.avail_in)
       {
-        int new_len = ctx_bin2base64 (data, 
-            encoded_len,
-            (char*)audio_packet_a85);
-        data = audio_packet_a85;
-        data_len = new_len;
+        packet->frames = 0;
+        packet->start  = packet->data;
+        packet->len    = sprintf (packet->data, "\e_Ao=Z;zlib error-\e\\");
+        atty_queue_push (&speaker_packet_queue);
+        packet = &speaker_packets[atty_queue_reserve (&speaker_packet_queue)];
+        packet->len = 0;
+        break;
       }
-      else
+      encoded_len = sizeof (audio_packet_z) - deflate_stream.avail_out;
+      data = audio_packet_z;
+    }
+    else if (compression == 'i')
+    {
+      int16_t samples[4096 * 2];
+      memcpy (samples, data, len);
+      encoded_len = apc_adpcm_encode (&adpcm, channels, samples,
+                                      len / frame_bytes, audio_packet_z);
+      data = audio_packet_z;
+    }
+    else if (compression == 'l')
+    {
+      encoded_len = apc_lossless_encode (data, len / frame_bytes, channels,
+                                         type, bits, audio_packet_z);
+      data = audio_packet_z;
+    }
+#ifdef HAVE_OPUS
+    else if (compression == 'o')
+    {
+      /* the final opus frame of the stream is padded with silence, f=
+       * tells the terminal how much of it to play
+       */
+      int opus_bytes = opus_frames * frame_bytes;
+      encoded_len = 0;
+      for (int pos = 0; pos < len; pos += opus_bytes)
       {
-        // we need a text encoding
-        return;
+        int16_t pcm[2880 * 2];
+        int take = MIN (opus_bytes, len - pos);
+        int ret;
+        memcpy (pcm, audio_packet + pos, take);
+        memset ((uint8_t*)pcm + take, 0, opus_bytes - take);
+        ret = apc_opus_encode (opus_enc, pcm, opus_frames,
+                               audio_packet_z + encoded_len);
+        if (ret < 0)
+        {
+          fprintf (stderr, "opus error %i\n", ret);
+          break;
+        }
+        encoded_len += ret;
       }
-
-      fprintf (stdout, "\033_Af=%i;", len / channels / (bits/8));
-      //fwrite (data, 1, strlen ((char*)data), stdout);
-      fwrite (data, 1, data_len, stdout);
-      fwrite ("\e\\", 1, 2, stdout);
-      fflush (stdout);
-
-      buffered_bytes += len;
-      len = 0;
+      data = audio_packet_z;
     }
+#endif
+    /* the block can be refilled while the packet is finished */
+    if (data != audio_packet)
+      atty_queue_pop (&speaker_block_queue);
+
+    int payload_len;
+    if (encoding == 'a')
+      payload_len = a85enc (data, apc_frame_payload (packet->data), encoded_len);
+    else
+      payload_len = ctx_bin2base64 (data, encoded_len, apc_frame_payload (packet->data));
+    packet->start = apc_frame_seal (packet->data, payload_len, len / frame_bytes,
+                                    restart, &packet->len);
+    restart = "";
+
+    if (data == audio_packet)
+      atty_queue_pop (&speaker_block_queue);
+    atty_queue_push (&speaker_packet_queue);
   }
+
+  /* the end of the stream, or a packet that ends it */
+  atty_queue_push (&speaker_packet_queue);
+  pthread_join (writer, NULL);
+
+  if (compression == 'Z')
+    deflateEnd (&deflate_stream);
+#ifdef HAVE_OPUS
+  if (opus_enc)
+    opus_encoder_destroy (opus_enc);
+#endif
 }
 
 ///////
@@ -542,11 +1031,115 @@ void atty_speaker (void)
 ///////
 
 static int in_audio_data = 0;
+static int in_silence = 0;
 
 static char audio_packet[65536];
 static int audio_packet_pos = 0;
 static int frames = 0;
 
+static z_stream mic_inflate;
+static int      mic_inflate_state = 0; // 1 initialized 2 restart pending
+
+/* writes a decoded mic packet to stdout, decompressing it first */
+static void mic_write (uint8_t *data, int len)
+{
+  if (compression == 'z')
+  {
+    unsigned long actual_uncompressed_size = frames * bits/8 * channels + 16;
+    unsigned char *data2 = malloc (actual_uncompressed_size);
+    /* if a buf size is set (rather compression, but
+     * this works first..) then */
+    int z_result = uncompress (data2, &actual_uncompressed_size,
+                               data, len);
+    if (z_result == Z_OK || z_result == Z_BUF_ERROR)
+    {
+      if (z_result != Z_OK)
+         fprintf (stderr, "[[z error:%i %i]]", __LINE__, z_result);
+      fwrite (data2, 1, actual_uncompressed_size, stdout);
+    }
+    free (data2);
+  }
+  else if (compression == 'Z')
+  {
+    uint8_t out[4096];
+    int z_result = Z_OK;
+
+    if (!mic_inflate_state)
+      inflateInit (&mic_inflate);
+    else if (mic_inflate_state == 2)
+      inflateReset (&mic_inflate);
+    mic_inflate_state = 1;
+
+    mic_inflate.next_in  = data;
+    mic_inflate.avail_in = len;
+    do {
+      mic_inflate.next_out  = out;
+      mic_inflate.avail_out = sizeof (out);
+      z_result = inflate (&mic_inflate, Z_SYNC_FLUSH);
+      fwrite (out, 1, sizeof (out) - mic_inflate.avail_out, stdout);
+    } while (z_result == Z_OK && mic_inflate.avail_out == 0);
+    if (z_result != Z_OK && z_result != Z_BUF_ERROR)
+      fprintf (stderr, "[[z error:%i %i]]", __LINE__, z_result);
+  }
+  else if (compression == 'i')
+  {
+    ApcAdpcm state = {{0, 0}, {0, 0}};
+    int count = len - APC_ADPCM_HEADER * channels;
+    if (count > 0 && channels <= 2)
+    {
+      int16_t *pcm = malloc (count * 2 * sizeof (int16_t));
+      int got;
+      apc_adpcm_read_header (&state, channels, data);
+      got = apc_adpcm_decode (&state, channels,
+                              data + APC_ADPCM_HEADER * channels, count,
+                              pcm, channels);
+      if (frames && frames < got)
+        got = frames;
+      fwrite (pcm, 2 * channels, got, stdout);
+      free (pcm);
+    }
+  }
+  else if (compression == 'l')
+  {
+    int bytes = frames * (type == 'u' ? 1 : bits/8) * channels;
+    uint8_t *pcm = malloc (bytes);
+    if (apc_lossless_decode (data, len, frames, channels, type, bits, pcm) == 0)
+      fwrite (pcm, 1, bytes, stdout);
+    free (pcm);
+  }
+#ifdef HAVE_OPUS
+  else if (compression == 'o')
+  {
+    static OpusDecoder  *opus_dec = NULL;
+    static ApcOpusUnpack unpack;
+    int16_t pcm[APC_OPUS_FRAME_MAX * 2];
+    const uint8_t *pos = data;
+    int packet_len;
+
+    if (!opus_dec)
+    {
+      int error;
+      opus_dec = opus_decoder_create (sample_rate, channels, &error);
+      if (!opus_dec)
+        return;
+    }
+    unpack.len = 0;
+    while ((packet_len = apc_opus_unpack (&unpack, &pos, &len)) > 0)
+    {
+      int got = opus_decode (opus_dec, unpack.buf + 2, packet_len,
+                             pcm, APC_OPUS_FRAME_MAX, 0);
+      if (got > 0)
+        fwrite (pcm, 2 * channels, got, stdout);
+    }
+  }
+#endif
+  else
+  {
+    fwrite (data, 1, len, stdout);
+  }
+  fflush (stdout);
+}
+
 static int mic_iterate (int timeoutms)
 {
   unsigned char buf[20];
@@ -577,46 +1170,36 @@ static int mic_iterate (int timeoutms)
       else if (buf[0] == '\\' &&
                in_audio_data == 2)
       {
-        if (encoding == 'a')
+        if (in_silence)
         {
-          unsigned char *temp = malloc (a85len (audio_packet, audio_packet_pos));
-          int len = a85dec (audio_packet, (char*)temp, audio_packet_pos);
-
-          if (compression == 'z')
-          {
-            unsigned long actual_uncompressed_size = frames * bits/8 * channels + 16;
-            unsigned char *data2 = malloc (actual_uncompressed_size);
-      /* if a buf size is set (rather compression, but
-       * this works first..) then */
-            int z_result = uncompress (data2, &actual_uncompressed_size,
-                                 temp, len);
-            if (z_result == Z_OK || z_result == Z_BUF_ERROR)
-            {
-              if (z_result != Z_OK)
-                 fprintf (stderr, "[[z error:%i %i]]", __LINE__, z_result);
-              fwrite (data2, 1, actual_uncompressed_size, stdout);
-            }
-            free (data2);
-          }
-          else
-          {
-            fwrite (temp, 1, len, stdout);
-          }
-
+          /* a suppressed quiet packet, the level is not reproduced */
+          int bytes = frames * (type == 'u' ? 1 : bits/8) * channels;
+          uint8_t *silence = malloc (bytes);
+          memset (silence, type == 'u' ? 0xff : 0, bytes);
+          fwrite (silence, 1, bytes, stdout);
           fflush (stdout);
+          free (silence);
+        }
+        else if (encoding == 'a')
+        {
+          int capacity = frames * bits/8 * channels;
+          if (compression == 'z' || compression == 'Z')
+            capacity = compressBound (capacity);
+          if (frames == 0 || compression == 'l' || compression == 'o')
+            capacity = a85dec_max (audio_packet_pos);
+          unsigned char *temp = malloc (capacity + 1);
+          int len = a85dec_bounded (audio_packet, (char*)temp,
+                                    audio_packet_pos, capacity);
+          mic_write (temp, len);
           free (temp);
         }
         else if (encoding == 'b')
         {
           uint8_t *temp = malloc (audio_packet_pos);
           int len = audio_packet_pos;
-          ctx_base642bin (audio_packet,
-                  &len,
-                  temp);
-          // XXX : NYI compression inside base64
-
-          fwrite (temp, 1, len, stdout);
-          fflush (stdout);
+          ctx_base642bin_len (audio_packet, audio_packet_pos,
+                              &len, temp);
+          mic_write (temp, len);
           free (temp);
         }
 
@@ -659,6 +1242,11 @@ static int mic_iterate (int timeoutms)
            {
              frames = atoi (strstr ((char*)tmp, "f=")+2);
            }
+           in_silence = (strstr ((char*)tmp, "a=s") != NULL);
+           if (strstr ((char*)tmp, "o=Z") && mic_inflate_state)
+           {
+             mic_inflate_state = 2;
+           }
            in_audio_data = 1;
            return 1;
          }
@@ -16,42 +16,245 @@
  */
 
 static const char *base64_map="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=";
-static void bin2base64_group (const unsigned char *in, int remaining, char *out)
+
+/* SSSE3 and AVX2 kernels handle the bulk of the data, whole groups at the
+ * end and anything the vector validation rejects is done by the scalar
+ * code, both produce identical output.
+ */
+#include <limits.h>
+
+#ifndef BASE64_SIMD
+#if !defined(BASE64_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define BASE64_SIMD 1
+#else
+#define BASE64_SIMD 0
+#endif
+#endif
+
+/* number of characters ctx_bin2base64 produces for bin_length bytes,
+ * not counting the terminating 0
+ */
+static inline int ctx_base64_len (int bin_length)
+{
+  return (bin_length + 2) / 3 * 4;
+}
+
+/* number of bytes decoding ascii_length characters produces, exact for
+ * unbroken padded base64 and an upper bound otherwise
+ */
+static inline int ctx_base64_binlen (const char *ascii, int ascii_length)
+{
+  int len = ascii_length / 4 * 3 + (ascii_length % 4) * 3 / 4;
+  if (ascii_length > 0 && ascii[ascii_length-1] == '=') len--;
+  if (ascii_length > 1 && ascii[ascii_length-2] == '=') len--;
+  return len;
+}
+
+#if BASE64_SIMD
+#include <immintrin.h>
+
+/* 0 scalar, 1 SSSE3, 2 AVX2 */
+static int base64_simd_level (void)
+{
+  static int level = -1;
+  if (level < 0)
+  {
+    __builtin_cpu_init ();
+    level = __builtin_cpu_supports ("avx2")  ? 2 :
+            __builtin_cpu_supports ("ssse3") ? 1 : 0;
+  }
+  return level;
+}
+
+static const int8_t base64_enc_shift[16] = {
+  'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+  '0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0 };
+static const int8_t base64_enc_split[16] = {
+  1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10 };
+
+/* the decoder classifies characters by their low and high nibble, a
+ * character is plain base64 when the two lookups share no bits, roll maps
+ * the alphabet ranges to sextets
+ */
+static const int8_t base64_dec_lut_lo[16] = {
+  0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+  0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a };
+static const int8_t base64_dec_lut_hi[16] = {
+  0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+  0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 };
+static const int8_t base64_dec_roll[16] = {
+  0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0 };
+static const int8_t base64_dec_pack[16] = {
+  2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 };
+
+#define BASE64_LUT128(lut) _mm_loadu_si128 ((const __m128i*)(lut))
+#define BASE64_LUT256(lut) _mm256_broadcastsi128_si256 (BASE64_LUT128 (lut))
+
+/* 12 bytes in, 16 characters out */
+__attribute__((target("ssse3")))
+static int bin2base64_ssse3 (const uint8_t *in, int length, char *out)
 {
-  unsigned char digit[4] = {0,0,64,64};
+  const __m128i split = BASE64_LUT128 (base64_enc_split);
+  const __m128i shift = BASE64_LUT128 (base64_enc_shift);
   int i;
-  digit[0] = in[0] >> 2;
-  digit[1] = ((in[0] & 0x03) << 4) | ((in[1] & 0xf0) >> 4);
-  if (remaining > 1)
-    {
-      digit[2] = ((in[1] & 0x0f) << 2) | ((in[2] & 0xc0) >> 6);
-      if (remaining > 2)
-        digit[3] = ((in[2] & 0x3f));
-    }
-  for (i = 0; i < 4; i++)
-    out[i] = base64_map[digit[i]];
+  for (i = 0; i + 16 <= length; i += 12)
+  {
+    __m128i v = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*)(in + i)), split);
+    __m128i hi = _mm_mulhi_epu16 (_mm_and_si128 (v, _mm_set1_epi32 (0x0fc0fc00)),
+                                  _mm_set1_epi32 (0x04000040));
+    __m128i lo = _mm_mullo_epi16 (_mm_and_si128 (v, _mm_set1_epi32 (0x003f03f0)),
+                                  _mm_set1_epi32 (0x01000010));
+    __m128i idx = _mm_or_si128 (hi, lo);
+    __m128i r = _mm_subs_epu8 (idx, _mm_set1_epi8 (51));
+    r = _mm_or_si128 (r, _mm_and_si128 (_mm_cmpgt_epi8 (_mm_set1_epi8 (26), idx),
+                                        _mm_set1_epi8 (13)));
+    v = _mm_add_epi8 (_mm_shuffle_epi8 (shift, r), idx);
+    _mm_storeu_si128 ((__m128i*)(out + i / 3 * 4), v);
+  }
+  return i;
+}
+
+/* 24 bytes in, 32 characters out */
+__attribute__((target("avx2")))
+static int bin2base64_avx2 (const uint8_t *in, int length, char *out)
+{
+  const __m256i split = BASE64_LUT256 (base64_enc_split);
+  const __m256i shift = BASE64_LUT256 (base64_enc_shift);
+  int i;
+  for (i = 0; i + 28 <= length; i += 24)
+  {
+    __m256i v = _mm256_inserti128_si256 (_mm256_castsi128_si256 (
+                  _mm_loadu_si128 ((const __m128i*)(in + i))),
+                  _mm_loadu_si128 ((const __m128i*)(in + i + 12)), 1);
+    v = _mm256_shuffle_epi8 (v, split);
+    __m256i hi = _mm256_mulhi_epu16 (_mm256_and_si256 (v, _mm256_set1_epi32 (0x0fc0fc00)),
+                                     _mm256_set1_epi32 (0x04000040));
+    __m256i lo = _mm256_mullo_epi16 (_mm256_and_si256 (v, _mm256_set1_epi32 (0x003f03f0)),
+                                     _mm256_set1_epi32 (0x01000010));
+    __m256i idx = _mm256_or_si256 (hi, lo);
+    __m256i r = _mm256_subs_epu8 (idx, _mm256_set1_epi8 (51));
+    r = _mm256_or_si256 (r, _mm256_and_si256 (_mm256_cmpgt_epi8 (_mm256_set1_epi8 (26), idx),
+                                              _mm256_set1_epi8 (13)));
+    v = _mm256_add_epi8 (_mm256_shuffle_epi8 (shift, r), idx);
+    _mm256_storeu_si256 ((__m256i*)(out + i / 3 * 4), v);
+  }
+  return i;
+}
+
+/* decodes runs of plain base64 characters, 16 at a time, returns the
+ * number of characters consumed, stopping before the first block holding
+ * padding, whitespace or the url safe variants.
+ */
+__attribute__((target("ssse3")))
+static int base642bin_ssse3 (const char *ascii, int length, uint8_t *out)
+{
+  const __m128i lut_lo = BASE64_LUT128 (base64_dec_lut_lo);
+  const __m128i lut_hi = BASE64_LUT128 (base64_dec_lut_hi);
+  const __m128i roll   = BASE64_LUT128 (base64_dec_roll);
+  const __m128i pack   = BASE64_LUT128 (base64_dec_pack);
+  const __m128i nibble = _mm_set1_epi8 (0x0f);
+  int i;
+  for (i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i v = _mm_loadu_si128 ((const __m128i*)(ascii + i));
+    __m128i hi_nibbles = _mm_and_si128 (_mm_srli_epi32 (v, 4), nibble);
+    __m128i class = _mm_and_si128 (_mm_shuffle_epi8 (lut_lo, _mm_and_si128 (v, nibble)),
+                                   _mm_shuffle_epi8 (lut_hi, hi_nibbles));
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (class, _mm_setzero_si128 ())) != 0xffff)
+      break;
+    __m128i eq_2f = _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('/'));
+    v = _mm_add_epi8 (v, _mm_shuffle_epi8 (roll, _mm_add_epi8 (eq_2f, hi_nibbles)));
+    v = _mm_maddubs_epi16 (v, _mm_set1_epi32 (0x01400140));
+    v = _mm_madd_epi16 (v, _mm_set1_epi32 (0x00011000));
+    v = _mm_shuffle_epi8 (v, pack);
+
+    uint8_t *dst = out + i / 4 * 3;
+    int32_t last = _mm_cvtsi128_si32 (_mm_srli_si128 (v, 8));
+    _mm_storel_epi64 ((__m128i*)dst, v);
+    memcpy (dst + 8, &last, 4);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static int base642bin_avx2 (const char *ascii, int length, uint8_t *out)
+{
+  const __m256i lut_lo = BASE64_LUT256 (base64_dec_lut_lo);
+  const __m256i lut_hi = BASE64_LUT256 (base64_dec_lut_hi);
+  const __m256i roll   = BASE64_LUT256 (base64_dec_roll);
+  const __m256i pack   = BASE64_LUT256 (base64_dec_pack);
+  const __m256i nibble = _mm256_set1_epi8 (0x0f);
+  int i;
+  for (i = 0; i + 32 <= length; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256 ((const __m256i*)(ascii + i));
+    __m256i hi_nibbles = _mm256_and_si256 (_mm256_srli_epi32 (v, 4), nibble);
+    if (!_mm256_testz_si256 (_mm256_shuffle_epi8 (lut_lo, _mm256_and_si256 (v, nibble)),
+                             _mm256_shuffle_epi8 (lut_hi, hi_nibbles)))
+      break;
+    __m256i eq_2f = _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('/'));
+    v = _mm256_add_epi8 (v, _mm256_shuffle_epi8 (roll, _mm256_add_epi8 (eq_2f, hi_nibbles)));
+    v = _mm256_maddubs_epi16 (v, _mm256_set1_epi32 (0x01400140));
+    v = _mm256_madd_epi16 (v, _mm256_set1_epi32 (0x00011000));
+    v = _mm256_shuffle_epi8 (v, pack);
+
+    uint8_t *dst = out + i / 4 * 3;
+    __m128i lo = _mm256_castsi256_si128 (v);
+    __m128i hi = _mm256_extracti128_si256 (v, 1);
+    int32_t last_lo = _mm_cvtsi128_si32 (_mm_srli_si128 (lo, 8));
+    int32_t last_hi = _mm_cvtsi128_si32 (_mm_srli_si128 (hi, 8));
+    _mm_storel_epi64 ((__m128i*)dst, lo);
+    memcpy (dst + 8, &last_lo, 4);
+    _mm_storel_epi64 ((__m128i*)(dst + 12), hi);
+    memcpy (dst + 20, &last_hi, 4);
+  }
+  return i;
 }
+#endif
 
+static inline void bin2base64_group (const unsigned char *in, char *out)
+{
+  out[0] = base64_map[in[0] >> 2];
+  out[1] = base64_map[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+  out[2] = base64_map[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+  out[3] = base64_map[in[2] & 0x3f];
+}
+
+/* encodes bin_length bytes to ascii, which must have room for
+ * ctx_base64_len (bin_length) + 1 bytes, returns the encoded length
+ */
 static inline int
 ctx_bin2base64 (const void *bin,
                 int         bin_length,
                 char       *ascii)
 {
-  /* this allocation is a hack to ensure we always produce the same result,
-   * regardless of padding data accidentally taken into account.
-   */
-  unsigned char *bin2 = calloc (bin_length + 4, 1);
-  unsigned const char *p = bin2;
-  int i;
-  memcpy (bin2, bin, bin_length);
-  for (i=0; i*3 < bin_length; i++)
-   {
-     int remaining = bin_length - i*3;
-     bin2base64_group (&p[i*3], remaining, &ascii[i*4]);
-   }
-  free (bin2);
-  ascii[i*4]=0;
-  return strlen (ascii);
+  const unsigned char *p = bin;
+  int i = 0;
+#if BASE64_SIMD
+  int level = base64_simd_level ();
+  if (level >= 2)
+    i = bin2base64_avx2 (p, bin_length, ascii);
+  if (level >= 1)
+    i += bin2base64_ssse3 (p + i, bin_length - i, ascii + i / 3 * 4);
+#endif
+  for (; i + 3 <= bin_length; i += 3)
+    bin2base64_group (&p[i], &ascii[i / 3 * 4]);
+
+  /* the partial group is padded with zero bits and '=' */
+  if (i < bin_length)
+  {
+    unsigned char tail[3] = {0,0,0};
+    char *out = &ascii[i / 3 * 4];
+    memcpy (tail, &p[i], bin_length - i);
+    bin2base64_group (tail, out);
+    out[3] = '=';
+    if (bin_length - i == 1)
+      out[2] = '=';
+  }
+  i = ctx_base64_len (bin_length);
+  ascii[i]=0;
+  return i;
 }
 
 static unsigned char base64_revmap[255];
@@ -76,26 +279,66 @@ static void base64_revmap_init (void)
   done = 1;
 }
 
+/* incremental decoder state, allowing a payload to be decoded in pieces
+ * as it arrives, zero initialize before the first piece.
+ */
+typedef struct Base64Dec {
+  int carry;
+  int charno;
+} Base64Dec;
+
+/* decodes as much of ascii_length characters as fits in capacity bytes of
+ * bin, skipping anything that is not part of the alphabet. Returns the
+ * number of bytes written and stores the number of characters used in
+ * consumed, the rest should be fed again once bin has been drained.
+ */
 static int
-ctx_base642bin (const char    *ascii,
-                int           *length,
-                unsigned char *bin)
+ctx_base642bin_stream (Base64Dec     *dec,
+                       const char    *ascii,
+                       int            ascii_length,
+                       unsigned char *bin,
+                       int            capacity,
+                       int           *consumed)
 {
-  int i;
-  int charno = 0;
+  int i = 0;
+  int charno = dec->charno;
   int outputno = 0;
-  int carry = 0;
+  int carry = dec->carry;
+#if BASE64_SIMD
+  int level = base64_simd_level ();
+  int simd_stop = -1;
+#endif
   base64_revmap_init ();
-  for (i = 0; ascii[i]; i++)
+
+  for (; i < ascii_length; i++)
     {
-      int bits = base64_revmap[((const unsigned char*)ascii)[i]];
-      if (length && outputno > *length)
+#if BASE64_SIMD
+      /* at a group boundary, decode runs of plain characters in bulk,
+       * keeping the vector stores inside capacity
+       */
+      if (level && charno % 4 == 0 && i > simd_stop)
         {
-          *length = -1;
-          return -1;
+          int limit = ascii_length - i;
+          int done = 0;
+          if ((capacity - outputno) / 3 < limit / 4)
+            limit = (capacity - outputno) / 3 * 4;
+          if (level >= 2)
+            done = base642bin_avx2 (ascii + i, limit, bin + outputno);
+          done += base642bin_ssse3 (ascii + i + done, limit - done,
+                                    bin + outputno + done / 4 * 3);
+          i += done;
+          charno += done;
+          outputno += done / 4 * 3;
+          simd_stop = i;
+          if (i >= ascii_length)
+            break;
         }
+#endif
+      int bits = base64_revmap[((const unsigned char*)ascii)[i]];
       if (bits != 255)
         {
+          if (charno % 4 != 0 && outputno >= capacity)
+            break;
           switch (charno % 4)
             {
               case 0:
@@ -120,11 +363,46 @@ ctx_base642bin (const char    *ascii,
           charno++;
         }
     }
+  dec->carry = carry;
+  dec->charno = charno % 4;
+  *consumed = i;
+  return outputno;
+}
+
+/* decodes ascii_length characters, skipping anything that is not part of
+ * the alphabet. If length is non-NULL it holds the capacity of bin on
+ * entry, -1 is returned if the output would not fit. bin gets a
+ * terminating 0 after the decoded bytes.
+ */
+static inline int
+ctx_base642bin_len (const char    *ascii,
+                    int            ascii_length,
+                    int           *length,
+                    unsigned char *bin)
+{
+  Base64Dec dec = {0, 0};
+  int consumed;
+  int outputno = ctx_base642bin_stream (&dec, ascii, ascii_length, bin,
+                                        length ? *length : INT_MAX,
+                                        &consumed);
+  if (consumed < ascii_length)
+    {
+      *length = -1;
+      return -1;
+    }
   bin[outputno]=0;
   if (length)
     *length= outputno;
   return outputno;
 }
 
+static inline int
+ctx_base642bin (const char    *ascii,
+                int           *length,
+                unsigned char *bin)
+{
+  return ctx_base642bin_len (ascii, strlen (ascii), length, bin);
+}
+
 
 ////
@@ -0,0 +1,84 @@
+/* atty - audio interface and driver for terminals
+ * Copyright (C) 2020 Øyvind Kolås <pippin@gimp.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* packets framed in buffers of exactly apc_frame_size bytes, for short
+ * payloads with both encodings, checked against a guard behind the buffer
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "../a85.h"
+#include "../base64.h"
+#include "../apc-frame.h"
+
+#define GUARD 16
+
+static int failures = 0;
+
+static void test_frame (const uint8_t *payload, int count, int encoding)
+{
+  int   size = apc_frame_size (count);
+  char *buf  = malloc (size + GUARD);
+  char *start;
+  int   payload_len;
+  int   len;
+
+  memset (buf + size, 0x5a, GUARD);
+  if (encoding == 'a')
+    payload_len = a85enc (payload, apc_frame_payload (buf), count);
+  else
+    payload_len = ctx_bin2base64 (payload, count, apc_frame_payload (buf));
+  start = apc_frame_seal (buf, payload_len, count, "", &len);
+
+  for (int i = 0; i < GUARD; i++)
+    if (buf[size + i] != 0x5a)
+    {
+      fprintf (stderr, "e=%c with %i bytes wrote past the %i byte buffer\n",
+               encoding, count, size);
+      failures++;
+      break;
+    }
+  if (start < buf || start + len > buf + size ||
+      memcmp (start + len - 2, "\033\\", 2))
+  {
+    fprintf (stderr, "e=%c with %i bytes is not framed\n", encoding, count);
+    failures++;
+  }
+  free (buf);
+}
+
+int main (int argc, char **argv)
+{
+  uint8_t payload[64];
+
+  for (int count = 0; count <= 12; count++)
+  {
+    /* plain groups, and zero groups which ascii85 abbreviates */
+    for (int i = 0; i < count; i++)
+      payload[i] = 0x80 + i;
+    test_frame (payload, count, 'a');
+    test_frame (payload, count, 'b');
+    memset (payload, 0, count);
+    test_frame (payload, count, 'a');
+  }
+
+  if (failures)
+    return 1;
+  printf ("apc-frame: ok\n");
+  return 0;
+}
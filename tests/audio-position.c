@@ -0,0 +1,150 @@
+/* atty - audio interface and driver for terminals
+ * Copyright (C) 2020 Øyvind Kolås <pippin@gimp.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* the a=p position and k=1 credits of the default stream while a bell
+ * and a second stream are mixed over it into the push mode queue, built
+ * against tests/sdl/SDL.h
+ */
+#include "../atty-vt.c"
+
+void atty_noraw (void) { }
+void atty_raw (void) { }
+
+static char replies[4096];
+static int  replies_len = 0;
+
+static ssize_t test_write (void *serial_obj, const void *buf, size_t count)
+{
+  if (replies_len + count < sizeof (replies))
+  {
+    memcpy (replies + replies_len, buf, count);
+    replies_len += count;
+    replies[replies_len] = 0;
+  }
+  return count;
+}
+
+static void test_feed (VT *vt, const char *str)
+{
+  vt_feed (vt, (const uint8_t*)str, strlen (str));
+}
+
+/* feeds frames of 16bit stereo silence, to stream id when it is not 0 */
+static void test_play (VT *vt, int id, int frames)
+{
+  static int16_t pcm[4096 * 2];
+  static char    encoded[sizeof (pcm) * 2];
+  char header[64];
+
+  ctx_bin2base64 (pcm, frames * 4, encoded);
+  if (id)
+    sprintf (header, "\033_Ai=%i,f=%i;", id, frames);
+  else
+    sprintf (header, "\033_Af=%i;", frames);
+  test_feed (vt, header);
+  test_feed (vt, encoded);
+  test_feed (vt, "\033\\");
+}
+
+static int failures = 0;
+
+/* asks for the position and checks the P= and Q= of the reply */
+static void test_position (VT *vt, unsigned int played, int device_queued)
+{
+  unsigned int P = 0;
+  int Q = -1;
+  char *reply;
+
+  replies_len = 0;
+  test_feed (vt, "\033_Aa=p;\033\\");
+  reply = strstr (replies, "P=");
+  if (reply)
+    sscanf (reply, "P=%u,q=%*i,Q=%i", &P, &Q);
+  if (P != played || Q != device_queued)
+  {
+    fprintf (stderr, "a=p: expected P=%u,Q=%i got %s\n",
+             played, device_queued, replies + 1);
+    failures++;
+  }
+}
+
+static void test_credit (VT *vt, unsigned int played)
+{
+  unsigned int P = 0;
+  char *reply;
+
+  replies_len = 0;
+  vt_audio_credit (vt, 1);
+  reply = strstr (replies, "P=");
+  if (reply)
+    sscanf (reply, "P=%u", &P);
+  if (P != played)
+  {
+    fprintf (stderr, "k=1: expected P=%u got %s\n", played, replies + 1);
+    failures++;
+  }
+}
+
+int main (int argc, char **argv)
+{
+  VT *vt = vt_new (NULL, 80, 24, 14, 1.0);
+
+  vt->write = test_write;
+  test_feed (vt, "\033_AT=s,b=16,c=2,s=48000,e=b,o=0,B=4096,k=1;\033\\");
+
+  /* the default stream is shorter than the bell and the second stream */
+  test_play (vt, 0, 1000);
+  test_play (vt, 2, 3000);
+  vt_bell (vt);
+  vt_audio_task (vt, 0);
+  if (SDL_GetQueuedAudioSize (speaker_device) / 4 <= 1000)
+  {
+    fprintf (stderr, "expected more than the default stream queued\n");
+    failures++;
+  }
+  test_position (vt, 0, 1000);
+  test_credit (vt, 0);
+
+  fake_sdl_play (600);
+  test_position (vt, 600, 400);
+  test_credit (vt, 600);
+
+  fake_sdl_play (1000);
+  test_position (vt, 1000, 0);
+  test_credit (vt, 1000);
+
+  /* queued again behind what is left of the bell */
+  test_play (vt, 0, 500);
+  vt_audio_task (vt, 0);
+  fake_sdl_play (200);
+  test_position (vt, 1000, 500);
+
+  /* a flush only counts the default stream */
+  replies_len = 0;
+  test_feed (vt, "\033_Aa=f;\033\\");
+  if (!strstr (replies, "f=500;"))
+  {
+    fprintf (stderr, "a=f: expected f=500 got %s\n", replies + 1);
+    failures++;
+  }
+  test_position (vt, 1000, 0);
+
+  if (failures)
+    return 1;
+  printf ("audio-position: ok\n");
+  return 0;
+}
@@ -0,0 +1,112 @@
+/* atty - audio interface and driver for terminals
+ * Copyright (C) 2020 Øyvind Kolås <pippin@gimp.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* the part of SDL the engine uses, with a push mode device whose queue
+ * only drains when a test plays it with fake_sdl_play
+ */
+#ifndef FAKE_SDL_H
+#define FAKE_SDL_H
+#include <stdint.h>
+
+typedef uint8_t  Uint8;
+typedef uint16_t Uint16;
+typedef uint32_t Uint32;
+typedef Uint32   SDL_AudioDeviceID;
+typedef Uint16   SDL_AudioFormat;
+typedef void (*SDL_AudioCallback) (void *userdata, Uint8 *stream, int len);
+
+typedef struct SDL_AudioSpec {
+  int               freq;
+  SDL_AudioFormat   format;
+  Uint8             channels;
+  Uint8             silence;
+  Uint16            samples;
+  Uint16            padding;
+  Uint32            size;
+  SDL_AudioCallback callback;
+  void             *userdata;
+} SDL_AudioSpec;
+
+#define AUDIO_S16      0x8010
+#define SDL_INIT_AUDIO 0x10
+#define SDL_TRUE       1
+
+static Uint32 fake_sdl_queued = 0;   /* bytes in the device queue */
+
+static inline int SDL_Init (Uint32 flags)
+{
+  return 0;
+}
+
+static inline const char *SDL_GetAudioDeviceName (int index, int capture)
+{
+  return "fake";
+}
+
+static inline SDL_AudioDeviceID SDL_OpenAudioDevice (const char *device,
+                                                     int capture,
+                                                     const SDL_AudioSpec *want,
+                                                     SDL_AudioSpec *got,
+                                                     int allowed)
+{
+  *got = *want;
+  fake_sdl_queued = 0;
+  return capture ? 2 : 1;
+}
+
+static inline void SDL_PauseAudioDevice (SDL_AudioDeviceID dev, int paused)
+{
+}
+
+static inline void SDL_CloseAudioDevice (SDL_AudioDeviceID dev)
+{
+  fake_sdl_queued = 0;
+}
+
+static inline void SDL_LockAudioDevice (SDL_AudioDeviceID dev)
+{
+}
+
+static inline void SDL_UnlockAudioDevice (SDL_AudioDeviceID dev)
+{
+}
+
+static inline Uint32 SDL_GetQueuedAudioSize (SDL_AudioDeviceID dev)
+{
+  return fake_sdl_queued;
+}
+
+static inline int SDL_QueueAudio (SDL_AudioDeviceID dev, const void *data,
+                                  Uint32 len)
+{
+  fake_sdl_queued += len;
+  return 0;
+}
+
+static inline void SDL_ClearQueuedAudio (SDL_AudioDeviceID dev)
+{
+  fake_sdl_queued = 0;
+}
+
+/* plays frames of 16bit stereo from the queue */
+static inline void fake_sdl_play (int frames)
+{
+  Uint32 bytes = frames * 4;
+  fake_sdl_queued = bytes > fake_sdl_queued ? 0 : fake_sdl_queued - bytes;
+}
+
+#endif
@@ -20,36 +20,8 @@
 #include <SDL.h>
 #endif
 #include <zlib.h>
-
-static int ydec (const void *srcp, void *dstp, int count)
-{
-  const char *src = srcp;
-  char *dst = dstp;
-  int out_len = 0;
-  for (int i = 0; i < count; i ++)
-  {
-    int o = src[i];
-    switch (o)
-    {
-      case '=':
-              i++;
-              o = src[i];
-              o = (o-42-64) % 256;
-              break;
-      case '\n':
-      case '\033':
-      case '\r':
-      case '\0':
-              break;
-      default:
-              o = (o-42) % 256;
-              break;
-    }
-    dst[out_len++] = o;
-  }
-  dst[out_len]=0;
-  return out_len;
-}
+#include <stdatomic.h>
+#include <limits.h>
 
 #ifndef NO_SDL
 static SDL_AudioDeviceID speaker_device = 0;
@@ -59,72 +31,356 @@ static SDL_AudioDeviceID speaker_device = 0;
 
 // our pcm queue is currently always 16 bit
 // signed stereo
+//
+// it is a single-producer/single-consumer ring, the producer is the
+// escape sequence parser and the consumer either vt_audio_task or the
+// SDL audio thread. The positions are free running frame counters, only
+// the owning side stores to its position.
+
+/* the speaker is opened once at this rate, streams are resampled to it */
+#define VT_AUDIO_DEVICE_RATE  48000
+
+#define PCM_QUEUE_FRAMES  (1<<17)  /* must be a power of two */
+#define PCM_QUEUE_MASK    (PCM_QUEUE_FRAMES-1)
 
-static int16_t pcm_queue[1<<18];
-static int     pcm_write_pos = 0;
-static int     pcm_read_pos  = 0;
+/* the most frames a single packet can give in f= */
+#define VT_AUDIO_MAX_FRAMES  PCM_QUEUE_FRAMES
 
-void terminal_queue_pcm (int16_t sample_left, int16_t sample_right)
+typedef struct PcmRing {
+  int16_t     *data;
+  unsigned int mask;      // frames - 1
+  atomic_uint  write_pos;
+  atomic_uint  read_pos;
+} PcmRing;
+
+static int16_t pcm_queue_data[PCM_QUEUE_FRAMES * 2];
+static PcmRing pcm_queue = {pcm_queue_data, PCM_QUEUE_MASK, 0, 0};
+
+/* number of frames available for reading */
+static inline int pcm_ring_used (PcmRing *ring)
 {
-  if (pcm_write_pos >= (1<<18)-1)
-  {
-    /*  TODO  :  fix cyclic buffer */
-    pcm_write_pos = 0;
-    pcm_read_pos  = 0;
-  }
-  pcm_queue[pcm_write_pos++]=sample_left;
-  pcm_queue[pcm_write_pos++]=sample_right;
+  return atomic_load_explicit (&ring->write_pos, memory_order_acquire) -
+         atomic_load_explicit (&ring->read_pos, memory_order_acquire);
 }
 
-float click_volume = 0.05;
+/* number of frames that can be written without overrunning the reader */
+static inline int pcm_ring_free (PcmRing *ring)
+{
+  return (int)(ring->mask + 1) - pcm_ring_used (ring);
+}
 
-void vt_feed_audio (VT *vt, void *samples, int bytes);
-int mic_device = 0;   // when non 0 we have an active mic device
+/* append up to count interleaved stereo frames, returns number of frames
+ * queued, frames that do not fit are dropped.
+ */
+static int pcm_ring_push (PcmRing *ring, const int16_t *frames, int count)
+{
+  unsigned int pos = atomic_load_explicit (&ring->write_pos, memory_order_relaxed);
+  unsigned int read_pos = atomic_load_explicit (&ring->read_pos, memory_order_acquire);
+  int size  = ring->mask + 1;
+  int space = size - (int)(pos - read_pos);
+  int first;
+
+  if (count > space)
+    count = space;
+  if (count <= 0)
+    return 0;
+
+  first = size - (pos & ring->mask);
+  if (first > count)
+    first = count;
+  memcpy (&ring->data[(pos & ring->mask) * 2], frames, first * 4);
+  memcpy (&ring->data[0], frames + first * 2, (count - first) * 4);
+
+  atomic_store_explicit (&ring->write_pos, pos + count, memory_order_release);
+  return count;
+}
 
+/* remove up to count frames into dst, returns number of frames read */
+static int pcm_ring_pop (PcmRing *ring, int16_t *dst, int count)
+{
+  unsigned int pos = atomic_load_explicit (&ring->read_pos, memory_order_relaxed);
+  unsigned int write_pos = atomic_load_explicit (&ring->write_pos, memory_order_acquire);
+  int size      = ring->mask + 1;
+  int available = (int)(write_pos - pos);
+  int first;
+
+  if (count > available)
+    count = available;
+  if (count <= 0)
+    return 0;
+
+  first = size - (pos & ring->mask);
+  if (first > count)
+    first = count;
+  memcpy (dst, &ring->data[(pos & ring->mask) * 2], first * 4);
+  memcpy (dst + first * 2, &ring->data[0], (count - first) * 4);
+
+  atomic_store_explicit (&ring->read_pos, pos + count, memory_order_release);
+  return count;
+}
 
-/*  https://jonathanhays.me/2018/11/14/mu-law-and-a-law-compression-tutorial/
+/* discards all queued frames from the writing side, only safe while the
+ * reader is not running. Returns the number of frames dropped.
  */
+static int pcm_ring_drop (PcmRing *ring)
+{
+  unsigned int write_pos = atomic_load_explicit (&ring->write_pos, memory_order_acquire);
+  unsigned int pos = atomic_load_explicit (&ring->read_pos, memory_order_relaxed);
 
-static char MuLawCompressTable[256] =
+  atomic_store_explicit (&ring->read_pos, write_pos, memory_order_release);
+  return (int)(write_pos - pos);
+}
+
+static inline int pcm_queue_used (void)
 {
-   0,0,1,1,2,2,2,2,3,3,3,3,3,3,3,3,
-   4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
-   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
-   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
-   6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-   6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-   6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-   6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7
-};
+  return pcm_ring_used (&pcm_queue);
+}
+
+static inline int pcm_queue_free (void)
+{
+  return pcm_ring_free (&pcm_queue);
+}
+
+static int pcm_queue_pop (int16_t *dst, int count)
+{
+  return pcm_ring_pop (&pcm_queue, dst, count);
+}
+
+/* streams with an i= other than 0 have rings of their own, and are mixed
+ * into the output with the default stream. A slot is taken by the first
+ * packet for an id and is reclaimed once it has been drained and idle.
+ * The mixer reads active, gain, paused and the ring, which is why a slot
+ * is only taken or released with a pull mode callback locked out.
+ */
+#define VT_AUDIO_STREAMS        7         /* besides the default stream */
+#define VT_AUDIO_STREAM_FRAMES  (1<<15)   /* must be a power of two */
+#define VT_AUDIO_STREAM_IDLE    2000      /* ms a drained stream is kept */
+
+typedef struct VtAudioStream {
+  int          id;
+  atomic_int   active;
+  atomic_int   gain;       // g= in percent
+  atomic_int   paused;
+  long int     last_used;  // ticks of the last packet
+  PcmRing      ring;
+  AudioState   state;      // format and decoders of the stream
+} VtAudioStream;
+
+static int16_t       pcm_stream_data[VT_AUDIO_STREAMS][VT_AUDIO_STREAM_FRAMES * 2];
+static VtAudioStream vt_audio_streams[VT_AUDIO_STREAMS];
+static atomic_int    vt_audio_main_gain = 100;  // g= of the default stream
+
+/* clips uploaded with a=u are kept decoded, as stereo frames at the device
+ * rate, and a=x starts a voice that the mixer plays straight from the
+ * cache. The mixer clears active when a voice is done, a sample is only
+ * freed with a pull mode callback locked out.
+ */
+#define VT_AUDIO_SAMPLE_CACHE  (16 << 20)  /* bytes of PCM kept */
+#define VT_AUDIO_VOICES        16
+
+typedef struct VtAudioSample {
+  int           id;
+  int16_t      *data;
+  int           frames;
+  int           capacity;  // frames allocated
+  unsigned int  used;      // LRU stamp
+  struct VtAudioSample *next;
+} VtAudioSample;
+
+typedef struct VtAudioVoice {
+  atomic_int     active;
+  VtAudioSample *sample;
+  uint64_t       pos;      // 16.16 fixed point frame position
+  uint32_t       step;     // r= as 16.16
+  int            gain;     // g= in percent
+} VtAudioVoice;
+
+static VtAudioSample *vt_audio_samples       = NULL;
+static size_t         vt_audio_samples_bytes = 0;
+static unsigned int   vt_audio_samples_clock = 0;
+static VtAudioVoice   vt_audio_voices[VT_AUDIO_VOICES];
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* adds count samples of src scaled by gain percent to dst, saturating */
+static void pcm_mix_add (int16_t *dst, const int16_t *src, int count, int gain)
+{
+  int scale = gain * 256 / 100;  // 8.8 fixed point
+  int i = 0;
+
+#ifdef __SSE2__
+  if (scale == 256)
+  {
+    for (; i + 8 <= count; i += 8)
+    {
+      __m128i d = _mm_loadu_si128 ((__m128i*)(dst + i));
+      __m128i s = _mm_loadu_si128 ((__m128i*)(src + i));
+      _mm_storeu_si128 ((__m128i*)(dst + i), _mm_adds_epi16 (d, s));
+    }
+  }
+  else
+  {
+    __m128i m = _mm_set1_epi16 (scale);
+    for (; i + 8 <= count; i += 8)
+    {
+      __m128i d  = _mm_loadu_si128 ((__m128i*)(dst + i));
+      __m128i s  = _mm_loadu_si128 ((__m128i*)(src + i));
+      __m128i lo = _mm_mullo_epi16 (s, m);
+      __m128i hi = _mm_mulhi_epi16 (s, m);
+      /* sum in 32bit, a gain above 100 can overflow the scaled sample */
+      __m128i a  = _mm_add_epi32 (_mm_srai_epi32 (_mm_unpacklo_epi16 (lo, hi), 8),
+                                  _mm_srai_epi32 (_mm_unpacklo_epi16 (d, d), 16));
+      __m128i b  = _mm_add_epi32 (_mm_srai_epi32 (_mm_unpackhi_epi16 (lo, hi), 8),
+                                  _mm_srai_epi32 (_mm_unpackhi_epi16 (d, d), 16));
+      _mm_storeu_si128 ((__m128i*)(dst + i), _mm_packs_epi32 (a, b));
+    }
+  }
+#endif
+  for (; i < count; i++)
+  {
+    int val = dst[i] + ((src[i] * scale) >> 8);
+    dst[i] = val < -32768 ? -32768 : val > 32767 ? 32767 : val;
+  }
+}
 
-unsigned char LinearToMuLawSample(int16_t sample)
+/* mixes up to count frames of a voice into dst, resampling linearly for
+ * r=, returns the frames written
+ */
+static int pcm_mix_voice (VtAudioVoice *voice, int16_t *dst, int count)
 {
-  const int cBias = 0x84;
-  const int cClip = 32635;
-  int sign = (sample >> 8) & 0x80;
+  const VtAudioSample *sample = voice->sample;
+  const int16_t *src = sample->data;
+  uint64_t pos   = voice->pos;
+  uint64_t end   = (uint64_t)sample->frames << 16;
+  int      scale = voice->gain * 256 / 100;
+  int      i;
+
+  for (i = 0; i < count && pos < end; i++, pos += voice->step)
+  {
+    int frame = pos >> 16;
+    int frac  = pos & 0xffff;
+    int next  = frame + 1 < sample->frames ? frame + 1 : frame;
+    for (int c = 0; c < 2; c++)
+    {
+      int a   = src[frame * 2 + c];
+      int b   = src[next * 2 + c];
+      int val = a + (((b - a) * frac) >> 16);
+      val = dst[i * 2 + c] + ((val * scale) >> 8);
+      dst[i * 2 + c] = val < -32768 ? -32768 : val > 32767 ? 32767 : val;
+    }
+  }
+  voice->pos = pos;
+  if (pos >= end)
+    atomic_store (&voice->active, 0);
+  return i;
+}
 
-  if (sign)
-    sample = (int16_t)-sample;
+/* frames the mixer can produce, the longest of the playing streams */
+static int pcm_mix_used (void)
+{
+  int used = pcm_queue_used ();
+  for (int i = 0; i < VT_AUDIO_VOICES; i++)
+  {
+    VtAudioVoice *voice = &vt_audio_voices[i];
+    if (atomic_load (&voice->active))
+    {
+      uint64_t left = ((uint64_t)voice->sample->frames << 16) - voice->pos;
+      int voice_used = (left + voice->step - 1) / voice->step;
+      if (voice_used > used)
+        used = voice_used;
+    }
+  }
+  for (int i = 0; i < VT_AUDIO_STREAMS; i++)
+  {
+    VtAudioStream *stream = &vt_audio_streams[i];
+    if (atomic_load (&stream->active) && !atomic_load (&stream->paused))
+    {
+      int stream_used = pcm_ring_used (&stream->ring);
+      if (stream_used > used)
+        used = stream_used;
+    }
+  }
+  return used;
+}
 
-  if (sample > cClip)
-    sample = cClip;
+/* mixes up to count frames of a ring into dst, returns the frames read */
+static int pcm_mix_ring (PcmRing *ring, int16_t *dst, int count, int gain)
+{
+  int16_t tmp[1024 * 2];
+  int done = 0;
 
-  sample = (int16_t)(sample + cBias);
+  while (done < count)
+  {
+    int got = pcm_ring_pop (ring, tmp, MIN (count - done, 1024));
+    if (!got)
+      break;
+    pcm_mix_add (dst + done * 2, tmp, got * 2, gain);
+    done += got;
+  }
+  return done;
+}
 
-  int exponent = (int)MuLawCompressTable[(sample>>7) & 0xFF];
-  int mantissa = (sample >> (exponent+3)) & 0x0F;
+/* the reading side of all rings, mixes up to count frames into dst and
+ * returns the number of frames produced, dst is silent beyond that
+ */
+static int pcm_mix_pop (int16_t *dst, int count)
+{
+  int gain = atomic_load (&vt_audio_main_gain);
+  int others = 0;
+  int frames;
 
-  int compressedByte = ~ (sign | (exponent << 4) | mantissa);
+  for (int i = 0; i < VT_AUDIO_STREAMS; i++)
+    others |= atomic_load (&vt_audio_streams[i].active);
+  for (int i = 0; i < VT_AUDIO_VOICES; i++)
+    others |= atomic_load (&vt_audio_voices[i].active);
+  if (!others && gain == 100)
+    return pcm_queue_pop (dst, count);
 
-  return (unsigned char)compressedByte;
+  memset (dst, 0, count * 4);
+  frames = pcm_mix_ring (&pcm_queue, dst, count, gain);
+  for (int i = 0; i < VT_AUDIO_STREAMS; i++)
+  {
+    VtAudioStream *stream = &vt_audio_streams[i];
+    if (atomic_load (&stream->active) && !atomic_load (&stream->paused))
+    {
+      int got = pcm_mix_ring (&stream->ring, dst, count,
+                              atomic_load (&stream->gain));
+      if (got > frames)
+        frames = got;
+    }
+  }
+  for (int i = 0; i < VT_AUDIO_VOICES; i++)
+  {
+    VtAudioVoice *voice = &vt_audio_voices[i];
+    if (atomic_load (&voice->active))
+    {
+      int got = pcm_mix_voice (voice, dst, count);
+      if (got > frames)
+        frames = got;
+    }
+  }
+  return frames;
+}
+
+float click_volume = 0.05;
+
+void vt_feed_audio (VT *vt, void *samples, int bytes);
+int mic_device = 0;   // when non 0 we have an active mic device
+static int mic_channels = 0;
+static int mic_samplerate = 0;
+
+
+/* room for size bytes in a mic buffer, kept for later packets */
+static void *vt_audio_mic_buffer (void *buf, int *cap, int size)
+{
+  if (size > *cap)
+  {
+    *cap = size;
+    buf = realloc (buf, size);
+  }
+  return buf;
 }
 
 void vt_feed_audio (VT *vt, void *samples, int bytes)
@@ -133,12 +389,27 @@ void vt_feed_audio (VT *vt, void *samples, int bytes)
   AudioState *audio = &vt->audio;
   uint8_t *data = samples;
   int frames = bytes / (audio->bits/8) / audio->channels;
+  const char *restart = "";
+
+  if (audio->dtx)
+  {
+    int level = apc_dtx_level (samples, frames, audio->channels,
+                               audio->type, audio->bits);
+    if (apc_dtx_quiet (&audio->dtx_state, audio->dtx, level))
+    {
+      vt_write (vt, buf, apc_dtx_message (buf, frames, level));
+#ifdef HAVE_OPUS
+      audio->opus_pcm_frames = 0;
+#endif
+      return;
+    }
+  }
 
   if (audio->compression == 'z')
   {
     uLongf len = compressBound(bytes);
-    data = malloc (len);
-    int z_result = compress (data, &len, samples, len);
+    data = audio->mic_z = vt_audio_mic_buffer (audio->mic_z, &audio->mic_z_cap, len);
+    int z_result = compress (data, &len, samples, bytes);
     if (z_result != Z_OK)
     {
       char buf[256]= "\033_Ao=z;zlib error2\033\\";
@@ -150,31 +421,135 @@ void vt_feed_audio (VT *vt, void *samples, int bytes)
       bytes = len;
     }
   }
+  else if (audio->compression == 'Z')
+  {
+    /* one deflate stream for the whole mic session, each packet ends
+     * with a sync flush so the receiver can decode it completely while
+     * the window keeps spanning packets
+     */
+    z_stream *z = audio->deflate;
+    if (!z)
+    {
+      z = audio->deflate = calloc (sizeof (z_stream), 1);
+      deflateInit (z, Z_DEFAULT_COMPRESSION);
+    }
+    else if (audio->deflate_fresh)
+    {
+      deflateReset (z);
+    }
+    audio->deflate_fresh = 0;
+    if (z->total_in == 0)
+      restart = ",o=Z"; /* tells the receiver to restart its inflate */
+
+    uLongf len = deflateBound (z, bytes) + 16;
+    data = audio->mic_z = vt_audio_mic_buffer (audio->mic_z, &audio->mic_z_cap, len);
+    z->next_in   = samples;
+    z->avail_in  = bytes;
+    z->next_out  = data;
+    z->avail_out = len;
+    deflate (z, Z_SYNC_FLUSH);
+    bytes = len - z->avail_out;
+  }
+  else if (audio->compression == 'i')
+  {
+    data  = audio->mic_z = vt_audio_mic_buffer (audio->mic_z, &audio->mic_z_cap,
+                                 apc_adpcm_bytes (frames, audio->channels));
+    bytes = apc_adpcm_encode (&audio->adpcm_enc, audio->channels,
+                              samples, frames, data);
+  }
+  else if (audio->compression == 'l')
+  {
+    data  = audio->mic_z = vt_audio_mic_buffer (audio->mic_z, &audio->mic_z_cap,
+                                 apc_lossless_bound (frames, audio->channels,
+                                                     audio->type, audio->bits));
+    bytes = apc_lossless_encode (samples, frames, audio->channels,
+                                 audio->type, audio->bits, data);
+  }
+#ifdef HAVE_OPUS
+  else if (audio->compression == 'o')
+  {
+    /* whole opus frames are encoded as the mic delivers them, the rest
+     * waits in opus_pcm for the next call
+     */
+    int channels   = audio->channels;
+    int frame_size = apc_opus_frame_size (audio->samplerate, audio->buffer_size);
+    const int16_t *pcm = samples;
+    int pcm_frames = bytes / 2 / channels;
+    int out_len    = 0;
+
+    if (audio->opus_enc &&
+        (audio->opus_enc_samplerate != audio->samplerate ||
+         audio->opus_enc_channels != channels))
+    {
+      opus_encoder_destroy (audio->opus_enc);
+      audio->opus_enc = NULL;
+    }
+    if (!audio->opus_enc)
+    {
+      int error;
+      audio->opus_enc = opus_encoder_create (audio->samplerate, channels,
+                                             OPUS_APPLICATION_VOIP, &error);
+      if (!audio->opus_enc)
+        return;
+      audio->opus_enc_samplerate = audio->samplerate;
+      audio->opus_enc_channels   = channels;
+      audio->opus_pcm_frames     = 0;
+    }
+    if (audio->opus_pcm_frames > frame_size)
+      audio->opus_pcm_frames = 0;
+
+    data = audio->mic_z = vt_audio_mic_buffer (audio->mic_z, &audio->mic_z_cap,
+                 (audio->opus_pcm_frames + pcm_frames) / frame_size *
+                 (APC_OPUS_PACKET_MAX + 2) + 1);
+    frames = 0;
+    while (pcm_frames > 0)
+    {
+      int take = MIN (frame_size - audio->opus_pcm_frames, pcm_frames);
+      memcpy (audio->opus_pcm + audio->opus_pcm_frames * channels, pcm,
+              take * channels * 2);
+      audio->opus_pcm_frames += take;
+      pcm        += take * channels;
+      pcm_frames -= take;
+
+      if (audio->opus_pcm_frames == frame_size)
+      {
+        int len = apc_opus_encode (audio->opus_enc, audio->opus_pcm,
+                                   frame_size, data + out_len);
+        if (len > 0)
+        {
+          out_len += len;
+          frames  += frame_size;
+        }
+        audio->opus_pcm_frames = 0;
+      }
+    }
+
+    if (!frames)
+      return;
+    bytes = out_len;
+  }
+#endif
 
-  char *encoded = malloc (bytes * 2);
-  encoded[0]=0;
+  /* the payload is encoded in place behind room for the header, and the
+   * packet goes out in one write
+   */
+  char *packet = audio->mic_packet =
+    vt_audio_mic_buffer (audio->mic_packet, &audio->mic_packet_cap,
+                         apc_frame_size (bytes));
+  char *start;
+  int encoded_len;
+  int packet_len;
   if (audio->encoding == 'a')
   {
-    a85enc (data, encoded, bytes);
+    encoded_len = a85enc (data, apc_frame_payload (packet), bytes);
   }
   else /* if (audio->encoding == 'b')  */
   {
-    ctx_bin2base64 (data, bytes, encoded);
+    encoded_len = ctx_bin2base64 (data, bytes, apc_frame_payload (packet));
   }
 
-  sprintf (buf, "\033[_Af=%i;", frames);
-  vt_write (vt, buf, strlen (buf));
-  vt_write (vt, encoded, strlen(encoded));
-  free (encoded);
-
-  if (data != samples)
-    free (data);
-
-  //vt_write (vt, samples, bytes);
-  buf[0]='\033';
-  buf[1]='\\';
-  buf[2]=0;
-  vt_write (vt, buf, 2);
+  start = apc_frame_seal (packet, encoded_len, frames, restart, &packet_len);
+  vt_write (vt, start, packet_len);
 }
 
 #define MIC_BUF_LEN 40960
@@ -182,67 +557,411 @@ void vt_feed_audio (VT *vt, void *samples, int bytes)
 uint8_t mic_buf[MIC_BUF_LEN];
 int     mic_buf_pos = 0;
 
+/* the mic is opened with the configured channels, its interleaved 16bit
+ * samples are encoded into the transfer format as they arrive
+ */
 static void mic_callback(void*     userdata,
                          uint8_t * stream,
                          int       len)
 {
   AudioState *audio = userdata;
   int16_t *sstream = (void*)stream;
-  int frames;
   int channels = audio->channels;
+  int samples = len / 2;
+  int bytes = apc_pcm_sample_bytes (audio->type, audio->bits);
+  ApcPcmEncode encode = apc_pcm_encoder (audio->type, audio->bits);
 
-  frames = len / 2;
+  if (!encode)
+    return;
 
-  if (audio->bits == 8)
+  /* encode whole frames in runs up to where the buffer wraps */
+  for (int i = 0; i < samples;)
   {
-    if (audio->type == 'u')
+    int room  = (MIC_BUF_LEN - 4 - mic_buf_pos) / (bytes * channels) * channels;
+    int count = samples - i < room ? samples - i : room;
+    if (count <= 0)
     {
-      for (int i = 0; i < frames; i++)
-      {
-        for (int c = 0; c < channels; c++)
-        {
-          mic_buf[mic_buf_pos++] = LinearToMuLawSample (sstream[i]);
-          if (mic_buf_pos >= MIC_BUF_LEN - 4)
-            mic_buf_pos = 0;
-        }
-      }
+      mic_buf_pos = 0;
+      continue;
     }
-    else
+    encode (sstream + i, count, mic_buf + mic_buf_pos);
+    mic_buf_pos += count * bytes;
+    i += count;
+  }
+}
+
+static long int ticks (void)
+{
+  struct timeval tp;
+  gettimeofday(&tp, NULL);
+  return tp.tv_sec * 1000 + tp.tv_usec / 1000;
+}
+
+static long long vt_audio_now_us (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static long int silence_start = 0;
+
+#ifndef NO_SDL
+static int speaker_device_pull = 0;
+
+/* pull model output, runs on the SDL audio thread and drains the pcm ring
+ * directly, padding with silence on underrun.
+ */
+static void speaker_callback (void    *userdata,
+                              uint8_t *stream,
+                              int      len)
+{
+  int frames = len / 4;
+  int got = pcm_mix_pop ((int16_t*)stream, frames);
+  if (got < frames)
+    memset (stream + got * 4, 0, (frames - got) * 4);
+}
+
+/* in push mode SDL's queue holds the mixed output of the default stream,
+ * the i= streams and the voices. For each queued chunk we keep how many
+ * frames of the default stream it starts with, which tells how much of
+ * the queue is still the default stream's.
+ */
+#define VT_AUDIO_CHUNKS 64
+
+typedef struct VtAudioChunk {
+  int frames;
+  int main;
+} VtAudioChunk;
+
+static VtAudioChunk vt_audio_chunks[VT_AUDIO_CHUNKS];
+static int vt_audio_chunk_first  = 0;
+static int vt_audio_chunk_count  = 0;
+static int vt_audio_chunk_frames = 0;
+
+static void vt_audio_chunk_add (int frames, int main)
+{
+  if (vt_audio_chunk_count == VT_AUDIO_CHUNKS)
+  {
+    /* out of records, the newest one grows */
+    VtAudioChunk *last = &vt_audio_chunks[(vt_audio_chunk_first +
+                                           VT_AUDIO_CHUNKS - 1) % VT_AUDIO_CHUNKS];
+    last->frames += frames;
+    last->main   += main;
+  }
+  else
+  {
+    VtAudioChunk *chunk = &vt_audio_chunks[(vt_audio_chunk_first +
+                                            vt_audio_chunk_count) % VT_AUDIO_CHUNKS];
+    chunk->frames = frames;
+    chunk->main   = main;
+    vt_audio_chunk_count++;
+  }
+  vt_audio_chunk_frames += frames;
+}
+
+static void vt_audio_chunks_clear (void)
+{
+  vt_audio_chunk_first  = 0;
+  vt_audio_chunk_count  = 0;
+  vt_audio_chunk_frames = 0;
+}
+#endif
+
+/* frames of the default stream handed to SDL in push mode and not played
+ * yet, in pull mode the callback takes them from the ring as they play
+ */
+static int vt_audio_device_main (void)
+{
+  int main = 0;
+#ifndef NO_SDL
+  int queued, played;
+
+  if (!speaker_device || speaker_device_pull)
+    return 0;
+  queued = SDL_GetQueuedAudioSize (speaker_device) / 4;
+
+  /* forget the chunks that have been played completely */
+  while (vt_audio_chunk_count &&
+         vt_audio_chunk_frames - vt_audio_chunks[vt_audio_chunk_first].frames >= queued)
+  {
+    vt_audio_chunk_frames -= vt_audio_chunks[vt_audio_chunk_first].frames;
+    vt_audio_chunk_first = (vt_audio_chunk_first + 1) % VT_AUDIO_CHUNKS;
+    vt_audio_chunk_count--;
+  }
+  if (!vt_audio_chunk_count)
+    return 0;
+
+  for (int i = 0; i < vt_audio_chunk_count; i++)
+    main += vt_audio_chunks[(vt_audio_chunk_first + i) % VT_AUDIO_CHUNKS].main;
+  /* the first chunk is playing, its default stream frames come first */
+  played = vt_audio_chunk_frames - queued;
+  if (played > 0)
+    main -= MIN (played, vt_audio_chunks[vt_audio_chunk_first].main);
+#endif
+  return main;
+}
+
+/* keeps a pull mode callback, the reader of the rings, from running */
+static void vt_audio_lock (void)
+{
+#ifndef NO_SDL
+  if (speaker_device && speaker_device_pull)
+    SDL_LockAudioDevice (speaker_device);
+#endif
+}
+
+static void vt_audio_unlock (void)
+{
+#ifndef NO_SDL
+  if (speaker_device && speaker_device_pull)
+    SDL_UnlockAudioDevice (speaker_device);
+#endif
+}
+
+/* frees the codec state and buffers of an AudioState */
+static void vt_audio_free (AudioState *audio)
+{
+  if (audio->inflate)
+  {
+    inflateEnd (audio->inflate);
+    free (audio->inflate);
+    audio->inflate = NULL;
+  }
+  if (audio->deflate)
+  {
+    deflateEnd (audio->deflate);
+    free (audio->deflate);
+    audio->deflate = NULL;
+  }
+  free (audio->block);
+  free (audio->block_pcm);
+  free (audio->upload_resample);
+  audio->upload_resample = NULL;
+  audio->block = NULL;
+  audio->block_pcm = NULL;
+  audio->block_cap = audio->block_pcm_cap = 0;
+  free (audio->mic_z);
+  free (audio->mic_packet);
+  audio->mic_z = NULL;
+  audio->mic_packet = NULL;
+  audio->mic_z_cap = audio->mic_packet_cap = 0;
+#ifdef HAVE_OPUS
+  if (audio->opus_dec)
+    opus_decoder_destroy (audio->opus_dec);
+  if (audio->opus_enc)
+    opus_encoder_destroy (audio->opus_enc);
+  audio->opus_dec = NULL;
+  audio->opus_enc = NULL;
+#endif
+  if (audio->upload)
+  {
+    free (audio->upload->data);
+    free (audio->upload);
+    audio->upload = NULL;
+  }
+}
+
+/* takes a stream slot out of the mixer and frees its decoders */
+static void vt_audio_stream_release (VtAudioStream *stream)
+{
+  if (atomic_load (&stream->active))
+  {
+    vt_audio_lock ();
+    atomic_store (&stream->active, 0);
+    vt_audio_unlock ();
+  }
+  vt_audio_free (&stream->state);
+}
+
+/* the slot of stream id, a new id takes a free slot or the least recently
+ * used drained one and starts out with the format of the default stream.
+ * NULL when all slots are busy.
+ */
+static VtAudioStream *vt_audio_stream_get (AudioState *device, int id)
+{
+  VtAudioStream *stream = NULL;
+
+  for (int i = 0; i < VT_AUDIO_STREAMS; i++)
+    if (atomic_load (&vt_audio_streams[i].active) && vt_audio_streams[i].id == id)
+      stream = &vt_audio_streams[i];
+
+  if (!stream)
+  {
+    for (int i = 0; i < VT_AUDIO_STREAMS; i++)
     {
-      for (int i = 0; i < frames; i++)
+      VtAudioStream *slot = &vt_audio_streams[i];
+      if (!atomic_load (&slot->active))
       {
-        for (int c = 0; c <  audio->channels; c++)
-        {
-          mic_buf[mic_buf_pos++] = (sstream[i]) / 256;
-          if (mic_buf_pos >= MIC_BUF_LEN - 4)
-            mic_buf_pos = 0;
-        }
+        stream = slot;
+        break;
       }
+      if (pcm_ring_used (&slot->ring) == 0 &&
+          (!stream || slot->last_used < stream->last_used))
+        stream = slot;
     }
+    if (!stream)
+      return NULL;
+    vt_audio_stream_release (stream);
+
+    memset (&stream->state, 0, sizeof (AudioState));
+    stream->state.samplerate  = device->samplerate;
+    stream->state.channels    = device->channels;
+    stream->state.bits        = device->bits;
+    stream->state.type        = device->type;
+    stream->state.encoding    = device->encoding;
+    stream->state.compression = device->compression;
+    stream->state.ring        = &stream->ring;
+
+    stream->ring.data = pcm_stream_data[stream - vt_audio_streams];
+    stream->ring.mask = VT_AUDIO_STREAM_FRAMES - 1;
+    atomic_store (&stream->ring.write_pos, 0);
+    atomic_store (&stream->ring.read_pos, 0);
+    atomic_store (&stream->gain, 100);
+    atomic_store (&stream->paused, 0);
+    stream->id = id;
+    atomic_store (&stream->active, 1);
   }
-  else
+  stream->state.buffer_size = device->buffer_size;
+  stream->last_used = ticks ();
+  return stream;
+}
+
+/* frees a cached sample, stopping the voices that play it */
+static void vt_audio_sample_free (VtAudioSample *sample)
+{
+  vt_audio_lock ();
+  for (int i = 0; i < VT_AUDIO_VOICES; i++)
+    if (atomic_load (&vt_audio_voices[i].active) &&
+        vt_audio_voices[i].sample == sample)
+      atomic_store (&vt_audio_voices[i].active, 0);
+  vt_audio_unlock ();
+  free (sample->data);
+  free (sample);
+}
+
+/* unlinks and frees the sample at link */
+static void vt_audio_sample_remove (VtAudioSample **link)
+{
+  VtAudioSample *sample = *link;
+  *link = sample->next;
+  vt_audio_samples_bytes -= (size_t)sample->frames * 4;
+  vt_audio_sample_free (sample);
+}
+
+/* collects the frames of an a=u upload, up to the size of the cache */
+static void vt_audio_sample_append (VtAudioSample *sample,
+                                    const int16_t *frames, int count)
+{
+  int max = VT_AUDIO_SAMPLE_CACHE / 4;
+
+  if (count > max - sample->frames)
+    count = max - sample->frames;
+  if (count <= 0)
+    return;
+  if (sample->frames + count > sample->capacity)
   {
-    for (int i = 0; i < frames; i++)
+    int capacity = MIN (sample->capacity ? sample->capacity * 2 : 4096, max);
+    int16_t *data;
+    if (capacity < sample->frames + count)
+      capacity = sample->frames + count;
+    data = realloc (sample->data, capacity * 4);
+    if (!data)
+      return;
+    sample->data     = data;
+    sample->capacity = capacity;
+  }
+  memcpy (sample->data + sample->frames * 2, frames, count * 4);
+  sample->frames += count;
+}
+
+/* adds a finished upload to the cache, replacing a sample with the same
+ * id and evicting the least recently used ones to stay within the cap
+ */
+static void vt_audio_sample_insert (VtAudioSample *sample)
+{
+  size_t bytes = (size_t)sample->frames * 4;
+  VtAudioSample **link;
+
+  for (link = &vt_audio_samples; *link; link = &(*link)->next)
+    if ((*link)->id == sample->id)
     {
-      for (int c = 0; c < audio->channels; c++)
-      {
-        *((int16_t*)(&mic_buf[mic_buf_pos])) = (sstream[i]);
-        mic_buf_pos+=2;
-        if (mic_buf_pos >= MIC_BUF_LEN - 4)
-          mic_buf_pos = 0;
-      }
+      vt_audio_sample_remove (link);
+      break;
     }
+
+  while (vt_audio_samples && vt_audio_samples_bytes + bytes > VT_AUDIO_SAMPLE_CACHE)
+  {
+    VtAudioSample **lru = &vt_audio_samples;
+    for (link = &vt_audio_samples; *link; link = &(*link)->next)
+      if ((int)((*link)->used - (*lru)->used) < 0)
+        lru = link;
+    vt_audio_sample_remove (lru);
   }
+
+  if (sample->capacity > sample->frames)
+    sample->data = realloc (sample->data, bytes);
+  sample->capacity = sample->frames;
+  sample->used = ++vt_audio_samples_clock;
+  sample->next = vt_audio_samples;
+  vt_audio_samples = sample;
+  vt_audio_samples_bytes += bytes;
 }
 
-static long int ticks (void)
+/* a=x, starts a voice playing a cached sample with gain and rate in
+ * percent, -1 when the sample is not in the cache. A trigger is dropped
+ * when all voices are busy.
+ */
+static void vt_audio_voice_start (VtAudioSample *sample, int gain, uint32_t step)
 {
-  struct timeval tp;
-  gettimeofday(&tp, NULL);
-  return tp.tv_sec * 1000 + tp.tv_usec / 1000;
+  for (int i = 0; i < VT_AUDIO_VOICES; i++)
+  {
+    VtAudioVoice *voice = &vt_audio_voices[i];
+    if (!atomic_load (&voice->active))
+    {
+      voice->sample = sample;
+      voice->pos    = 0;
+      voice->step   = step;
+      voice->gain   = gain;
+      atomic_store (&voice->active, 1);
+      break;
+    }
+  }
 }
 
-static long int silence_start = 0;
+static int vt_audio_sample_play (int id, int gain, int rate)
+{
+  VtAudioSample *sample = vt_audio_samples;
+
+  while (sample && sample->id != id)
+    sample = sample->next;
+  if (!sample)
+    return -1;
+  sample->used = ++vt_audio_samples_clock;
+  vt_audio_voice_start (sample, gain, (uint32_t)rate * 65536 / 100);
+  return 0;
+}
+
+static void vt_audio_samples_free (void)
+{
+  while (vt_audio_samples)
+    vt_audio_sample_remove (&vt_audio_samples);
+}
+
+/* reclaims the slots of streams that have been drained and idle */
+static void vt_audio_streams_reclaim (AudioState *device, int all)
+{
+  for (int i = 0; i < VT_AUDIO_STREAMS; i++)
+  {
+    VtAudioStream *stream = &vt_audio_streams[i];
+    if (all ||
+        (atomic_load (&stream->active) &&
+         device->current != &stream->state &&
+         pcm_ring_used (&stream->ring) == 0 &&
+         ticks () - stream->last_used > VT_AUDIO_STREAM_IDLE))
+      vt_audio_stream_release (stream);
+  }
+}
 
 static void sdl_audio_init ()
 {
@@ -259,12 +978,65 @@ static void sdl_audio_init ()
   }
 }
 
+/* tells a client that asked for credits with k=1 how many of the frames
+ * it sent have been played, the client keeps at most w= frames
+ * outstanding. Only sent when the position moved unless forced.
+ */
+static void vt_audio_credit (VT *vt, int force)
+{
+  AudioState *audio = &vt->audio;
+  char buf[128];
+  int queued;
+  unsigned int played;
+
+  if (!audio->credit)
+    return;
+  /* only the default stream's part of SDL's queue is the client's */
+  queued = pcm_queue_used () + vt_audio_device_main ();
+  played = atomic_load (&pcm_queue.write_pos) - audio->credit_base - queued;
+  if ((int)(played - audio->credit_played) < 0)
+    played = audio->credit_played;
+  if (played == audio->credit_played && !force)
+    return;
+  audio->credit_played = played;
+
+  /* the ring is at the device rate, the client counts frames it sent */
+  sprintf (buf, "\033_Ak=1,P=%u,F=%i,w=%i;\033\\",
+           (unsigned int)((uint64_t)played * audio->samplerate / VT_AUDIO_DEVICE_RATE),
+           (int)((int64_t)pcm_queue_free () * audio->samplerate / VT_AUDIO_DEVICE_RATE),
+           audio->buffer_size * 2);
+  vt_write (vt, buf, strlen (buf));
+}
+
+#ifndef NO_SDL
+/* closes the speaker, the default stream frames still queued with SDL
+ * are lost with it
+ */
+static void vt_audio_speaker_close (AudioState *audio)
+{
+  audio->dropped += vt_audio_device_main ();
+  vt_audio_chunks_clear ();
+  SDL_PauseAudioDevice(speaker_device, 1);
+  SDL_CloseAudioDevice(speaker_device);
+  speaker_device = 0;
+}
+#endif
+
 void vt_audio_task (VT *vt, int click)
 {
   if (!vt) return;
   AudioState *audio = &vt->audio;
 #ifndef NO_SDL
 
+  /* the mic records in the configured format, reopen it on changes */
+  if (mic_device && (!audio->mic || mic_channels != audio->channels ||
+                     mic_samplerate != audio->samplerate))
+  {
+    SDL_PauseAudioDevice(mic_device, 1);
+    SDL_CloseAudioDevice(mic_device);
+    mic_device = 0;
+  }
+
   if (audio->mic)
   {
     if (mic_device == 0)
@@ -273,7 +1045,7 @@ void vt_audio_task (VT *vt, int click)
       sdl_audio_init ();
 
       spec_want.freq     = audio->samplerate;
-      spec_want.channels = 1;
+      spec_want.channels = audio->channels;
       spec_want.format   = AUDIO_S16;
       spec_want.samples  = audio->buffer_size;
       spec_want.callback = mic_callback;
@@ -281,6 +1053,9 @@ void vt_audio_task (VT *vt, int click)
       mic_device = SDL_OpenAudioDevice(SDL_GetAudioDeviceName(0, SDL_TRUE), 1, &spec_want, &spec_got, 0);
 
       SDL_PauseAudioDevice(mic_device, 0);
+      audio->deflate_fresh = 1;
+      mic_channels = audio->channels;
+      mic_samplerate = audio->samplerate;
     }
 
     if (mic_buf_pos)
@@ -291,22 +1066,27 @@ void vt_audio_task (VT *vt, int click)
       SDL_UnlockAudioDevice (mic_device);
     }
   }
-  else
-  {
-    if (mic_device)
-    {
-      SDL_PauseAudioDevice(mic_device, 1);
-      SDL_CloseAudioDevice(mic_device);
-      mic_device = 0;
-    }
-  }
 
-  int free_frames = audio->buffer_size - SDL_GetQueuedAudioSize(speaker_device);
-  int queued = (pcm_write_pos - pcm_read_pos)/2; // 2 for stereo
-  //if (free_frames > 6) free_frames -= 4;
+  /* output mode changed, reopen the device */
+  if (speaker_device && speaker_device_pull != audio->pull)
+    vt_audio_speaker_close (audio);
+
+  int queued = pcm_mix_used ();
   int frames = queued;
 
-  if (frames > free_frames) frames = free_frames;
+  if (!audio->pull)
+  {
+    /* keep at most buffer_size frames, at the rate of the default stream,
+     * queued with SDL
+     */
+    int free_frames = (int64_t)audio->buffer_size * VT_AUDIO_DEVICE_RATE /
+                      audio->samplerate;
+    if (speaker_device)
+      free_frames -= SDL_GetQueuedAudioSize(speaker_device) / 4;
+    if (frames > free_frames) frames = free_frames;
+    if (audio->paused) frames = 0;
+  }
+
   if (frames > 0)
   {
     if (speaker_device == 0)
@@ -314,74 +1094,88 @@ void vt_audio_task (VT *vt, int click)
       SDL_AudioSpec spec_want, spec_got;
       sdl_audio_init ();
 
-       spec_want.freq = audio->samplerate;
-       if (audio->bits == 8 && audio->type == 'u')
-       {
-         spec_want.format = AUDIO_S16;
-         spec_want.channels = 2;
-       }
-       else if (audio->bits == 8 && audio->type == 's')
-       {
-         spec_want.format = AUDIO_S8;
-         spec_want.channels = audio->channels;
-       }
-       else if (audio->bits == 16 && audio->type == 's')
-       {
-         spec_want.format = AUDIO_S16;
-         spec_want.channels = audio->channels;
-       }
-       else
-       {
-         spec_want.format = AUDIO_S16; // XXX  : error
-         spec_want.channels = audio->channels;
-       }
+      spec_want.freq = VT_AUDIO_DEVICE_RATE;
 
-       /* In SDL we always set 16bit stereo, but with the
-        * requested sample rate.
-        */
+      /* In SDL we always set 16bit stereo at the device rate, the
+       * streams are resampled to it.
+       */
       spec_want.format = AUDIO_S16;
       spec_want.channels = 2;
 
       spec_want.samples = audio->buffer_size;
-      spec_want.callback = NULL;
+      spec_want.callback = audio->pull ? speaker_callback : NULL;
+      spec_want.userdata = NULL;
 
       speaker_device = SDL_OpenAudioDevice (NULL, 0, &spec_want, &spec_got, 0);
       if (!speaker_device){
         fprintf (stderr, "sdl openaudiodevice fail\n");
       }
-      SDL_PauseAudioDevice (speaker_device, 0);
+      speaker_device_pull = audio->pull;
+      SDL_PauseAudioDevice (speaker_device, audio->paused);
     }
 
-#if 0
+    if (!audio->pull)
     {
-       int i;
-       unsigned char *b = (void*)(&pcm_queue[pcm_read_pos]);
-       for (i = 0; i < frames * 4; i++)
-       {
-         if ((b[i] > ' ') && (b[i] <= '~'))
-           fprintf (stderr, "[%c]", b[i]);
-         else
-           fprintf (stderr, "[%i]", b[i]);
-       }
+      int16_t block[4096 * 2];
+      while (frames > 0)
+      {
+        unsigned int main = atomic_load (&pcm_queue.read_pos);
+        int got = pcm_mix_pop (block, MIN (frames, 4096));
+        if (!got)
+          break;
+        main = atomic_load (&pcm_queue.read_pos) - main;
+        SDL_QueueAudio (speaker_device, (void*)block, got * 4);
+        vt_audio_chunk_add (got, main);
+        frames -= got;
+      }
+    }
+    if (audio->arrival_us)
+    {
+      audio->latency_us = vt_audio_now_us () - audio->arrival_us;
+      if (audio->latency_us > audio->latency_max_us)
+        audio->latency_max_us = audio->latency_us;
+      audio->arrival_us = 0;
     }
-#endif
-    SDL_QueueAudio (speaker_device, (void*)&pcm_queue[pcm_read_pos], frames * 4);
-    pcm_read_pos += frames*2;
     silence_start = ticks();
   }
-  else
+  else if (queued == 0 && !audio->paused)
   {
-    if (speaker_device &&  (ticks() - silence_start >  2000))
-    {
-      SDL_PauseAudioDevice(speaker_device, 1);
-      SDL_CloseAudioDevice(speaker_device);
-      speaker_device = 0;
-    }
+    /* the device is kept open and plays silence until W= runs out, so
+     * the next sound does not wait for it to be opened again
+     */
+    if (speaker_device && audio->idle_ms &&
+        (ticks() - silence_start > audio->idle_ms))
+      vt_audio_speaker_close (audio);
   }
 #endif
+  vt_audio_streams_reclaim (audio, 0);
+  vt_audio_credit (vt, 0);
 }
 
-void terminal_queue_pcm (int16_t sample_left, int16_t sample_right);
+/* the interval in ms at which vt_audio_task wants to run to keep the
+ * device fed and the mic drained, 0 when audio is idle.
+ */
+static int vt_audio_interval (VT *vt)
+{
+#ifndef NO_SDL
+  AudioState *audio = &vt->audio;
+  int ms;
+  if (!mic_device && pcm_mix_used () == 0)
+  {
+    if (!speaker_device)
+      return 0;
+    /* a warm device with nothing left to play is only checked for the
+     * idle teardown
+     */
+    if (speaker_device_pull || SDL_GetQueuedAudioSize (speaker_device) == 0)
+      return 1000;
+  }
+  ms = audio->buffer_size * 1000 / audio->samplerate / 2;
+  return ms < 1 ? 1 : ms;
+#else
+  return 0;
+#endif
+}
 
 static unsigned char vt_bell_audio[] = {
 #if 1
@@ -1146,88 +1940,636 @@ static unsigned char vt_bell_audio[] = {
   0x7c, 0xfc, 0x7a, 0xf3, 0x70, 0xfd, 0x7e, 0x7d, 0xf3, 0x70, 0xf7, 0x78,
   0x7e, 0xf9, 0x72, 0xef, 0x77, 0xfc, 0xfd, 0x75, 0xee, 0x72, 0xf7, 0xfb
 #endif
-};
+};
+
+/* the bell is 8khz ulaw, it is played as a voice resampled to the device */
+void vt_bell (VT *vt)
+{
+  static VtAudioSample bell = {0,};
+  static int16_t data[sizeof (vt_bell_audio) * 2];
+
+  if (vt->bell < 2)
+    return;
+  if (!bell.data)
+  {
+    apc_ulaw_decode_block (vt_bell_audio, sizeof (vt_bell_audio), 1, data);
+    bell.data   = data;
+    bell.frames = sizeof (vt_bell_audio);
+  }
+  vt_audio_voice_start (&bell, vt->bell * 100 / 8,
+                        (uint32_t)8000 * 65536 / VT_AUDIO_DEVICE_RATE);
+}
+
+
+/* bytes per frame of the transfer format, ulaw implies 8bit */
+static inline int vt_audio_frame_bytes (AudioState *audio)
+{
+  return (audio->type == 'u' ? 1 : audio->bits/8) * audio->channels;
+}
+
+#define PCM_BLOCK_FRAMES 1024
+
+/* frames at the device rate go to the ring of the stream, or to the sample
+ * being uploaded
+ */
+static void vt_audio_deliver (AudioState *audio, const int16_t *frames, int count)
+{
+  if (audio->upload)
+    vt_audio_sample_append (audio->upload, frames, count);
+  else
+    pcm_ring_push (audio->ring, frames, count);
+}
+
+/* hands decoded stereo frames on, resampled to the device rate */
+static void vt_audio_emit (AudioState *audio, const int16_t *frames, int count)
+{
+  int16_t out[(APC_RESAMPLE_BLOCK * VT_AUDIO_DEVICE_RATE / 8000 + 2) * 2];
+  ApcResample *resample = &audio->resample;
+
+  if (audio->samplerate == VT_AUDIO_DEVICE_RATE)
+  {
+    vt_audio_deliver (audio, frames, count);
+    return;
+  }
+  /* an upload leaves the filter history of the stream alone */
+  if (audio->upload)
+  {
+    if (!audio->upload_resample)
+      audio->upload_resample = calloc (sizeof (ApcResample), 1);
+    if (!audio->upload_resample)
+      return;
+    resample = audio->upload_resample;
+  }
+  if (resample->in_rate != audio->samplerate)
+    apc_resample_init (resample, audio->samplerate, VT_AUDIO_DEVICE_RATE);
+  while (count > 0)
+  {
+    int chunk = MIN (count, APC_RESAMPLE_BLOCK);
+    int got   = apc_resample_process (resample, frames, chunk, out);
+    vt_audio_deliver (audio, out, got);
+    frames += chunk * 2;
+    count  -= chunk;
+  }
+}
+
+/* convert count frames of audio in the configured transfer format to
+ * interleaved signed 16bit stereo
+ */
+static void vt_audio_decode_block (AudioState *audio, const uint8_t *src,
+                                   int16_t *dst, int count)
+{
+  ApcPcmDecode decode = apc_pcm_decoder (audio->type, audio->bits,
+                                         audio->channels);
+  if (decode)
+    decode (src, count, dst);
+  else
+    memset (dst, 0, count * 4);
+}
+
+/* converts and queues whole frames of a streaming transfer, stopping
+ * once the announced frame count has been reached
+ */
+static void vt_audio_stream_frames (AudioState *audio, const uint8_t *src, int frames)
+{
+  int16_t block[PCM_BLOCK_FRAMES * 2];
+  int frame_bytes = vt_audio_frame_bytes (audio);
+
+  while (frames > 0 && audio->frames_left)
+  {
+    int count = MIN (PCM_BLOCK_FRAMES, frames);
+    if (audio->frames_left > 0 && count > audio->frames_left)
+      count = audio->frames_left;
+    vt_audio_decode_block (audio, src, block, count);
+    vt_audio_emit (audio, block, count);
+    src    += count * frame_bytes;
+    frames -= count;
+    if (audio->frames_left > 0)
+      audio->frames_left -= count;
+  }
+  /* an o=Z inflate has to consume the whole packet to stay in sync */
+  if (audio->frames_left == 0 && audio->compression != 'Z')
+    audio->streaming = 0;
+}
+
+/* last stage of the payload pipeline, raw samples to pcm, carrying a
+ * partial frame over to the next call
+ */
+static void vt_audio_stream_pcm (AudioState *audio, const uint8_t *data, int len)
+{
+  int frame_bytes = vt_audio_frame_bytes (audio);
+  int frames;
+
+  if (audio->frames_left == 0)
+    return;
+
+  if (audio->frame_buf_len)
+  {
+    int take = MIN (frame_bytes - audio->frame_buf_len, len);
+    memcpy (audio->frame_buf + audio->frame_buf_len, data, take);
+    audio->frame_buf_len += take;
+    data += take;
+    len  -= take;
+    if (audio->frame_buf_len < frame_bytes)
+      return;
+    vt_audio_stream_frames (audio, audio->frame_buf, 1);
+    audio->frame_buf_len = 0;
+  }
+
+  frames = len / frame_bytes;
+  vt_audio_stream_frames (audio, data, frames);
+  data += frames * frame_bytes;
+  len  -= frames * frame_bytes;
+
+  if (len && audio->streaming)
+  {
+    memcpy (audio->frame_buf, data, len);
+    audio->frame_buf_len = len;
+  }
+}
+
+/* middle stage of the payload pipeline for o=i, decodes nibbles straight
+ * into stereo blocks for the pcm ring
+ */
+static void vt_audio_stream_adpcm (AudioState *audio, const uint8_t *data, int len)
+{
+  int16_t block[PCM_BLOCK_FRAMES * 2];
+  int channels     = audio->channels;
+  int header_bytes = APC_ADPCM_HEADER * channels;
+
+  if (audio->adpcm_header_len < header_bytes)
+  {
+    int take = MIN (header_bytes - audio->adpcm_header_len, len);
+    memcpy (audio->adpcm_header + audio->adpcm_header_len, data, take);
+    audio->adpcm_header_len += take;
+    data += take;
+    len  -= take;
+    if (audio->adpcm_header_len < header_bytes)
+      return;
+    apc_adpcm_read_header (&audio->adpcm, channels, audio->adpcm_header);
+  }
+
+  while (len > 0 && audio->frames_left)
+  {
+    int count  = MIN (len, channels == 2 ? PCM_BLOCK_FRAMES : PCM_BLOCK_FRAMES / 2);
+    int frames = apc_adpcm_decode (&audio->adpcm, channels, data, count, block, 2);
+    if (audio->frames_left > 0 && frames > audio->frames_left)
+      frames = audio->frames_left;
+    vt_audio_emit (audio, block, frames);
+    if (audio->frames_left > 0)
+      audio->frames_left -= frames;
+    data += count;
+    len  -= count;
+  }
+  if (audio->frames_left == 0)
+    audio->streaming = 0;
+}
+
+/* middle stage of the payload pipeline for o=l, which needs the whole
+ * packet, it is decoded by vt_audio_stream_end
+ */
+static void vt_audio_stream_block (AudioState *audio, const uint8_t *data, int len)
+{
+  size_t bound = apc_lossless_bound (audio->frames, audio->channels,
+                                     audio->type, audio->bits);
+  if (bound > INT_MAX || (size_t)audio->block_len + len > bound)
+  {
+    audio->streaming = 0;
+    return;
+  }
+  if (audio->block_len + len > audio->block_cap)
+  {
+    audio->block_cap = bound;
+    audio->block = realloc (audio->block, audio->block_cap);
+  }
+  memcpy (audio->block + audio->block_len, data, len);
+  audio->block_len += len;
+}
+
+static void vt_audio_stream_block_end (AudioState *audio)
+{
+  size_t size = (size_t)audio->frames * vt_audio_frame_bytes (audio);
+  int bytes = size;
+  if (size > INT_MAX)
+    return;
+  if (bytes > audio->block_pcm_cap)
+  {
+    audio->block_pcm_cap = bytes;
+    audio->block_pcm = realloc (audio->block_pcm, audio->block_pcm_cap);
+  }
+  if (apc_lossless_decode (audio->block, audio->block_len, audio->frames,
+                           audio->channels, audio->type, audio->bits,
+                           audio->block_pcm) == 0)
+    vt_audio_stream_pcm (audio, audio->block_pcm, bytes);
+}
+
+#ifdef HAVE_OPUS
+/* middle stage of the payload pipeline for o=o, decodes each opus packet
+ * as soon as it is complete
+ */
+static void vt_audio_stream_opus (AudioState *audio, const uint8_t *data, int len)
+{
+  int16_t pcm[APC_OPUS_FRAME_MAX * 2];
+  int packet_len;
+
+  while (audio->streaming &&
+         (packet_len = apc_opus_unpack (&audio->opus_unpack, &data, &len)))
+  {
+    int frames;
+    if (packet_len < 0)
+    {
+      audio->streaming = 0;
+      break;
+    }
+    frames = opus_decode (audio->opus_dec, audio->opus_unpack.buf + 2,
+                          packet_len, pcm, APC_OPUS_FRAME_MAX, 0);
+    if (frames > 0)
+      vt_audio_stream_pcm (audio, (uint8_t*)pcm, frames * audio->channels * 2);
+  }
+}
+#endif
 
-static short MuLawDecompressTable[256] =
+/* middle stage of the payload pipeline, inflates decoded bytes when the
+ * transfer is compressed
+ */
+static void vt_audio_stream_bin (AudioState *audio, const uint8_t *data, int len)
 {
-     -32124,-31100,-30076,-29052,-28028,-27004,-25980,-24956,
-     -23932,-22908,-21884,-20860,-19836,-18812,-17788,-16764,
-     -15996,-15484,-14972,-14460,-13948,-13436,-12924,-12412,
-     -11900,-11388,-10876,-10364, -9852, -9340, -8828, -8316,
-      -7932, -7676, -7420, -7164, -6908, -6652, -6396, -6140,
-      -5884, -5628, -5372, -5116, -4860, -4604, -4348, -4092,
-      -3900, -3772, -3644, -3516, -3388, -3260, -3132, -3004,
-      -2876, -2748, -2620, -2492, -2364, -2236, -2108, -1980,
-      -1884, -1820, -1756, -1692, -1628, -1564, -1500, -1436,
-      -1372, -1308, -1244, -1180, -1116, -1052,  -988,  -924,
-       -876,  -844,  -812,  -780,  -748,  -716,  -684,  -652,
-       -620,  -588,  -556,  -524,  -492,  -460,  -428,  -396,
-       -372,  -356,  -340,  -324,  -308,  -292,  -276,  -260,
-       -244,  -228,  -212,  -196,  -180,  -164,  -148,  -132,
-       -120,  -112,  -104,   -96,   -88,   -80,   -72,   -64,
-        -56,   -48,   -40,   -32,   -24,   -16,    -8,     -1,
-      32124, 31100, 30076, 29052, 28028, 27004, 25980, 24956,
-      23932, 22908, 21884, 20860, 19836, 18812, 17788, 16764,
-      15996, 15484, 14972, 14460, 13948, 13436, 12924, 12412,
-      11900, 11388, 10876, 10364,  9852,  9340,  8828,  8316,
-       7932,  7676,  7420,  7164,  6908,  6652,  6396,  6140,
-       5884,  5628,  5372,  5116,  4860,  4604,  4348,  4092,
-       3900,  3772,  3644,  3516,  3388,  3260,  3132,  3004,
-       2876,  2748,  2620,  2492,  2364,  2236,  2108,  1980,
-       1884,  1820,  1756,  1692,  1628,  1564,  1500,  1436,
-       1372,  1308,  1244,  1180,  1116,  1052,   988,   924,
-        876,   844,   812,   780,   748,   716,   684,   652,
-        620,   588,   556,   524,   492,   460,   428,   396,
-        372,   356,   340,   324,   308,   292,   276,   260,
-        244,   228,   212,   196,   180,   164,   148,   132,
-        120,   112,   104,    96,    88,    80,    72,    64,
-         56,    48,    40,    32,    24,    16,     8,     0
-};
+  z_stream *z = audio->inflate;
+  uint8_t out[4096];
+
+#ifdef HAVE_OPUS
+  if (audio->compression == 'o')
+  {
+    vt_audio_stream_opus (audio, data, len);
+    return;
+  }
+#endif
+  if (audio->compression == 'l')
+  {
+    vt_audio_stream_block (audio, data, len);
+    return;
+  }
+  if (audio->compression == 'i')
+  {
+    vt_audio_stream_adpcm (audio, data, len);
+    return;
+  }
 
+  if (!audio->inflating)
+  {
+    vt_audio_stream_pcm (audio, data, len);
+    return;
+  }
 
-void vt_bell (VT *vt)
+  z->next_in  = (Bytef*)data;
+  z->avail_in = len;
+  while (audio->streaming)
+  {
+    int z_result;
+    z->next_out  = out;
+    z->avail_out = sizeof (out);
+    z_result = inflate (z, Z_NO_FLUSH);
+    vt_audio_stream_pcm (audio, out, sizeof (out) - z->avail_out);
+    if (z_result != Z_OK)
+    {
+      /* end of the compressed data, or corrupt data, either way we are
+       * done with this packet
+       */
+      if (z_result != Z_BUF_ERROR)
+        audio->streaming = 0;
+      break;
+    }
+    if (z->avail_out != 0 && z->avail_in == 0)
+      break;
+  }
+}
+
+static int vt_audio_ydec_stream (AudioState *audio, const uint8_t *src, int count,
+                                 uint8_t *dst, int capacity, int *consumed)
 {
-  if (vt->bell < 2)
+  int out_len = 0;
+  int i;
+  for (i = 0; i < count && out_len < capacity; i++)
+  {
+    int o = src[i];
+    if (audio->y_escape)
+    {
+      dst[out_len++] = o - 42 - 64;
+      audio->y_escape = 0;
+    }
+    else if (o == '=')
+      audio->y_escape = 1;
+    else if (o != '\n' && o != '\r')
+      dst[out_len++] = o - 42;
+  }
+  *consumed = i;
+  return out_len;
+}
+
+/* prepare for decoding the payload of a transfer as it arrives */
+static void vt_audio_stream_begin (AudioState *audio)
+{
+  memset (&audio->a85, 0, sizeof (audio->a85));
+  memset (&audio->b64, 0, sizeof (audio->b64));
+  audio->y_escape      = 0;
+  audio->frame_buf_len = 0;
+  audio->frames_left   = audio->frames ? audio->frames : -1;
+  audio->streaming     = apc_pcm_decoder (audio->type, audio->bits,
+                                        audio->channels) != NULL;
+  audio->inflating     = 0;
+
+  if (audio->streaming &&
+      (audio->compression == 'z' || audio->compression == 'Z'))
+  {
+    /* with o=Z the inflate stream spans packets and only restarts when
+     * the sender says so with o=Z
+     */
+    if (!audio->inflate)
+    {
+      audio->inflate = calloc (sizeof (z_stream), 1);
+      inflateInit (audio->inflate);
+    }
+    else if (audio->compression == 'z' || audio->inflate_fresh)
+    {
+      inflateReset (audio->inflate);
+    }
+    audio->inflate_fresh = 0;
+    audio->inflating = 1;
+  }
+
+  audio->adpcm_header_len = 0;
+
+  /* o=l packets are only decodable with their frame count */
+  if (audio->compression == 'l')
+  {
+    audio->block_len = 0;
+    if (audio->frames <= 0)
+      audio->streaming = 0;
+  }
+
+#ifdef HAVE_OPUS
+  if (audio->streaming && audio->compression == 'o')
+  {
+    if (audio->opus_dec &&
+        (audio->opus_dec_samplerate != audio->samplerate ||
+         audio->opus_dec_channels != audio->channels))
+    {
+      opus_decoder_destroy (audio->opus_dec);
+      audio->opus_dec = NULL;
+    }
+    if (!audio->opus_dec)
+    {
+      int error;
+      audio->opus_dec = opus_decoder_create (audio->samplerate,
+                                             audio->channels, &error);
+      audio->opus_dec_samplerate = audio->samplerate;
+      audio->opus_dec_channels   = audio->channels;
+    }
+    audio->opus_unpack.len = 0;
+    if (!audio->opus_dec)
+      audio->streaming = 0;
+  }
+#endif
+}
+
+/* first stage of the payload pipeline, called with payload text as it
+ * passes through the parser, decodes the text encoding into a small
+ * buffer that is passed on, keeping no copy of the payload
+ */
+void vt_audio_stream (VT *vt, const uint8_t *data, int len)
+{
+  AudioState *audio = vt->audio.current ? vt->audio.current : &vt->audio;
+  uint8_t bin[1024];
+
+  while (len > 0 && audio->streaming)
+  {
+    int used = len;
+    int bin_len = 0;
+    switch (audio->encoding)
+    {
+      case 'a':
+        bin_len = a85dec_stream (&audio->a85, (const char*)data, len,
+                                 (char*)bin, sizeof (bin), &used);
+        break;
+      case 'b':
+        bin_len = ctx_base642bin_stream (&audio->b64, (const char*)data, len,
+                                         bin, sizeof (bin), &used);
+        break;
+      case 'y':
+        bin_len = vt_audio_ydec_stream (audio, data, len,
+                                        bin, sizeof (bin), &used);
+        break;
+    }
+    vt_audio_stream_bin (audio, bin, bin_len);
+    data += used;
+    len  -= used;
+  }
+}
+
+/* the payload terminator has been seen */
+void vt_audio_stream_end (VT *vt)
+{
+  AudioState *audio = vt->audio.current ? vt->audio.current : &vt->audio;
+  if (audio->streaming && audio->encoding == 'a')
+  {
+    uint8_t tail[4];
+    int len = a85dec_stream_end (&audio->a85, (char*)tail);
+    vt_audio_stream_bin (audio, tail, len);
+  }
+  if (audio->streaming && audio->compression == 'l')
+    vt_audio_stream_block_end (audio);
+  audio->streaming = 0;
+  vt->audio.current = NULL;
+
+  if (audio->upload)
+  {
+    VtAudioSample *sample = audio->upload;
+    char buf[128];
+
+    /* push the tail of the clip out of the resampler */
+    if (audio->samplerate != VT_AUDIO_DEVICE_RATE)
+    {
+      int16_t silence[APC_RESAMPLE_TAPS * 2] = {0,};
+      vt_audio_emit (audio, silence, APC_RESAMPLE_TAPS / 2);
+    }
+    audio->upload = NULL;
+    sprintf (buf, "\033_Aa=u,I=%i,f=%i;OK\033\\", sample->id, sample->frames);
+    if (sample->frames)
+    {
+      vt_audio_sample_insert (sample);
+    }
+    else
+    {
+      free (sample->data);
+      free (sample);
+    }
+    vt_write (vt, buf, strlen (buf));
+  }
+}
+
+/* answers a=p with the frames of the default stream the device has played
+ * since the engine started, its frames waiting in the ring and in the SDL
+ * queue, all at the device rate, the monotonic time in microseconds at
+ * which this was sampled, and the last and worst delay of a sound after
+ * silence
+ */
+static void vt_audio_position (VT *vt)
+{
+  AudioState *audio = &vt->audio;
+  char buf[256];
+  int queued = pcm_queue_used ();
+  int device_queued = vt_audio_device_main ();
+  unsigned int played;
+
+  played = atomic_load (&pcm_queue.read_pos) - device_queued - audio->dropped;
+
+  sprintf (buf, "\033_Aa=p,P=%u,q=%i,Q=%i,s=%i,t=%lld,l=%i,L=%i;OK\033\\",
+           played, queued, device_queued, VT_AUDIO_DEVICE_RATE,
+           vt_audio_now_us (), audio->latency_us, audio->latency_max_us);
+  vt_write (vt, buf, strlen (buf));
+}
+
+/* a=f, drops everything queued in the ring and with SDL so a seek is
+ * heard right away, replies with the number of frames discarded
+ */
+static void vt_audio_flush (VT *vt, VtAudioStream *stream)
+{
+  AudioState *audio = &vt->audio;
+  char buf[128];
+  int dropped = 0;
+
+  if (stream)
+  {
+    /* SDL's queue holds mixed audio, only the ring is for this stream */
+    vt_audio_lock ();
+    dropped = pcm_ring_drop (&stream->ring);
+    vt_audio_unlock ();
+    sprintf (buf, "\033_Ai=%i,a=f,f=%i;OK\033\\", stream->id, dropped);
+    vt_write (vt, buf, strlen (buf));
     return;
-  for (int i = 0; i < (int)sizeof (vt_bell_audio); i++)
+  }
+
+  vt_audio_lock ();
+  dropped = pcm_ring_drop (&pcm_queue);
+  vt_audio_unlock ();
+#ifndef NO_SDL
+  if (speaker_device && !speaker_device_pull)
+  {
+    dropped += vt_audio_device_main ();
+    SDL_ClearQueuedAudio (speaker_device);
+    vt_audio_chunks_clear ();
+  }
+#endif
+  audio->dropped += dropped;
+
+  sprintf (buf, "\033_Aa=f,f=%i;OK\033\\", dropped);
+  vt_write (vt, buf, strlen (buf));
+}
+
+/* a=h and a=r, holds and resumes a stream in the mixer, or the device
+ * for the default stream without closing it
+ */
+static void vt_audio_pause (AudioState *audio, VtAudioStream *stream, int paused)
+{
+  if (stream)
   {
-    int16_t val = MuLawDecompressTable[vt_bell_audio[i]] * vt->bell / 8;
-    terminal_queue_pcm (val, val);
+    atomic_store (&stream->paused, paused);
+    return;
   }
+  audio->paused = paused;
+#ifndef NO_SDL
+  if (speaker_device)
+    SDL_PauseAudioDevice (speaker_device, paused);
+#endif
 }
 
+/* fills the gap of a suppressed packet with uniform noise of the level the
+ * sender measured
+ */
+static void vt_audio_silence (AudioState *audio, int frames, int level)
+{
+  int16_t block[PCM_BLOCK_FRAMES * 2];
+  int amplitude = MIN (level * 7 / 4, 32767); /* sqrt(3) times the RMS */
+
+  if (!audio->noise_seed)
+    audio->noise_seed = 1;
+  while (frames > 0)
+  {
+    int count = MIN (frames, PCM_BLOCK_FRAMES);
+    for (int i = 0; i < count * 2; i++)
+    {
+      uint32_t x = audio->noise_seed;
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      audio->noise_seed = x;
+      block[i] = amplitude ? (int)(x % (2 * amplitude + 1)) - amplitude : 0;
+    }
+    if (audio->channels == 1)
+      for (int i = 0; i < count; i++)
+        block[i * 2 + 1] = block[i * 2];
+    vt_audio_emit (audio, block, count);
+    frames -= count;
+  }
+}
 
-void terminal_queue_pcm (int16_t sample_left, int16_t sample_right);
+/* the value of the i= key of a command, 0 for the default stream */
+static int vt_audio_command_stream (const char *command)
+{
+  for (int pos = 1; command[pos] && command[pos] != ';'; pos++)
+    if ((command[pos-1] == 'A' || command[pos-1] == ',') &&
+        command[pos] == 'i' && command[pos+1] == '=')
+      return atoi (&command[pos+2]);
+  return 0;
+}
 
 void vt_audio (VT *vt, const char *command)
 {
-  AudioState *audio = &vt->audio;
+  AudioState *device = &vt->audio;
+  AudioState *audio  = device;
+  VtAudioStream *stream = NULL;
+  int id = vt_audio_command_stream (command);
   // the simplest form of audio is raw audio
   // _As=8000,c=2,b=8,e=u
   //
-  // multiple voices:
-  //   ids to queue - store samples as images...
+  // multiple voices: i=<id> selects a stream with its own format and
+  //   ring, the device keys B p m d k W are shared
   //
-  // reusing samples
+  // reusing samples: a=u,I=<id> uploads, a=x,I=<id> plays with g= and r=
   //   .. pitch bend and be able to do a mod player?
-  const char *payload = NULL;
   char key = 0;
   int  value;
+  int  query;
   int  pos = 1;
+  int  sample_id = 0;
+  int  gain = -1;
+  int  rate = 100;
+
+  device->current = NULL;
+  if (id)
+  {
+    stream = vt_audio_stream_get (device, id);
+    if (!stream)
+      return; // all slots busy, the packet is dropped
+    audio = &stream->state;
+    device->current = audio;
+  }
 
   audio->frames=0;
+  audio->noise=0;
   audio->action='t';
+  audio->streaming=0;
 
   int configure = 0;
-  while (command[pos] != ';')
+  while (command[pos] && command[pos] != ';')
   {
     pos ++; // G or ,
-    if (command[pos] == ';') break;
+    if (!command[pos] || command[pos] == ';') break;
     key = command[pos]; pos++;
-    if (command[pos] == ';') break;
+    if (!command[pos] || command[pos] == ';') break;
     pos ++; // =
-    if (command[pos] == ';') break;
+    if (!command[pos] || command[pos] == ';') break;
 
+    query = (command[pos] == '?');
     if (command[pos] >= '0' && command[pos] <= '9')
       value = atoi(&command[pos]);
     else
@@ -1236,20 +2578,33 @@ void vt_audio (VT *vt, const char *command)
            command[pos] != ',' &&
            command[pos] != ';') pos++;
     
-    if (value=='?')
+    if (query)
     {
       char buf[256];
       const char *range="";
       switch (key)
       {
-        case 's':range="8000,16000,24000,48000";break;
-        case 'b':range="8,16";break;
+        case 's':range="8000-192000";break;
+        case 'b':range="8,16,24,32";break;
         case 'B':range="512-65536";break;
         case 'c':range="1";break;
         case 'T':range="u,s,f";break;
         case 'e':range="b,a";break;
-        case 'o':range="z,0";break;
-        case 'a':range="t,q";break;
+#ifdef HAVE_OPUS
+        case 'o':range="z,Z,l,i,o,0";break;
+#else
+        case 'o':range="z,Z,l,i,0";break;
+#endif
+        case 'a':range="t,q,s,p,f,h,r,u,x";break;
+        case 'p':range="0,1";break;
+        case 'd':range="0-32767";break;
+        case 'k':range="0,1";break;
+        case 'i':range="0-65535";break;
+        case 'g':range="0-400";break;
+        case 'I':range="0-65535";break;
+        case 'r':range="25-400";break;
+        case 'W':range="0-3600000";break;
+        case 'f':range="0-131072";break;
         default:range="unknown";break;
       }
       sprintf (buf, "\033_A%c=?;%s\033\\", key, range);
@@ -1261,59 +2616,91 @@ void vt_audio (VT *vt, const char *command)
     {
       case 's': audio->samplerate = value; configure = 1; break;
       case 'b': audio->bits = value; configure = 1; break;
-      case 'B': audio->buffer_size = value; configure = 1; break;
+      case 'B': device->buffer_size = value; configure = 1; break;
       case 'c': audio->channels = value; configure = 1; break;
       case 'a': audio->action = value; configure = 1; break;
       case 'T': audio->type = value; configure = 1; break;
-      case 'f': audio->frames = value; configure = 1; break;
+      case 'f':
+        audio->frames = value < 0 ? 0 :
+                        value > VT_AUDIO_MAX_FRAMES ? VT_AUDIO_MAX_FRAMES : value;
+        configure = 1;
+        break;
       case 'e': audio->encoding = value; configure = 1; break;
-      case 'o': audio->compression = value; configure = 1; break;
+      case 'o':
+        audio->compression = value;
+        audio->inflate_fresh = audio->deflate_fresh = (value == 'Z');
+        configure = 1;
+        break;
+      case 'p': device->pull = value?1:0; break;
+      case 'W': device->idle_ms = value < 0 ? 0 : value; break;
+      case 'd': device->dtx = value; break;
+      case 'k':
+        device->credit        = value ? 1 : 0;
+        device->credit_base   = atomic_load (&pcm_queue.write_pos);
+        device->credit_played = 0;
+        vt_audio_credit (vt, 1);
+        break;
+      case 'n': audio->noise = value; break;
+      case 'g': gain = value < 0 ? 0 : value > 400 ? 400 : value; break;
+      case 'I': sample_id = value; break;
+      case 'r': rate = value < 25 ? 25 : value > 400 ? 400 : value; break;
       case 'm': 
-        audio->mic = value?1:0;
+        device->mic = value?1:0;
         break;
     }
 
     if (configure)
     {
-      /* these are the specific sample rates supported by opus,
-       * instead of enabling anything SDL supports, the initial
-       * implementation limits itself to the opus sample rates
-       */
-      if (audio->samplerate <= 8000)
-      {
+      /* any rate is resampled to the device */
+      if (audio->samplerate < 8000)
         audio->samplerate = 8000;
-      }
-      else if (audio->samplerate <= 16000)
-      {
-        audio->samplerate = 16000;
-      }
-      else if (audio->samplerate <= 24000)
-      {
-        audio->samplerate = 24000;
-      }
-      else
-      {
-        audio->samplerate = 48000;
-      }
+      else if (audio->samplerate > 192000)
+        audio->samplerate = 192000;
 
-      if (audio->bits != 8 && audio->bits != 16)
+      if (audio->bits != 8 && audio->bits != 16 &&
+          audio->bits != 24 && audio->bits != 32)
         audio->bits = 8;
 
-      if (audio->buffer_size > 2048)
-        audio->buffer_size = 2048;
-      else if (audio->buffer_size < 512)
-        audio->buffer_size = 512;
+      if (device->buffer_size > 2048)
+        device->buffer_size = 2048;
+      else if (device->buffer_size < 512)
+        device->buffer_size = 512;
+      audio->buffer_size = device->buffer_size;
 
       switch (audio->type)
       {
         case 'u':
+          audio->bits = 8;
+          break;
         case 's':
+          break;
         case 'f':
+          audio->bits = 32;
           break;
         default:
           audio->type = 's';
       }
 
+#ifndef HAVE_OPUS
+      if (audio->compression == 'o')
+        audio->compression = '0';
+#endif
+      /* opus and adpcm always carry 16bit signed samples */
+      if (audio->compression == 'o' || audio->compression == 'i')
+      {
+        audio->bits = 16;
+        audio->type = 's';
+      }
+      /* and opus only knows a few rates */
+      if (audio->compression == 'o')
+      {
+        static const int opus_rates[] = {8000, 12000, 16000, 24000, 48000};
+        int i = 0;
+        while (i < 4 && audio->samplerate > opus_rates[i])
+          i++;
+        audio->samplerate = opus_rates[i];
+      }
+
       /* only 1 and 2 channels supported */
       if (audio->channels <= 0 || audio->channels > 2)
       {
@@ -1322,225 +2709,61 @@ void vt_audio (VT *vt, const char *command)
     }
   }
   
-  if (audio->frames ||  audio->action != 'd')
-  {
-  payload = &command[pos+1];
+  /* g= is the gain of a trigger, or else of the stream */
+  if (gain >= 0 && audio->action != 'x')
+    atomic_store (stream ? &stream->gain : &vt_audio_main_gain, gain);
 
-  // accumulate incoming data
+  switch (audio->action)
   {
-     int chunk_size = strlen (payload);
-     int old_size = audio->data_size;
-     if (audio->data == NULL)
-     {
-       audio->data_size = chunk_size;
-       audio->data = malloc (audio->data_size + 1);
-     }
-     else
-     {
-       audio->data_size += chunk_size;
-       audio->data = realloc (audio->data, audio->data_size + 1);
-     }
-     memcpy (audio->data + old_size, payload, chunk_size);
-     audio->data[audio->data_size]=0;
-  }
-
-    if (audio->frames)
-    switch (audio->encoding)
-    {
-      case 'y':
-        audio->data_size = ydec (audio->data, audio->data, audio->data_size);
+    case 't': // transfer, the payload is decoded by vt_audio_stream
+      if (!device->arrival_us && pcm_mix_used () == 0)
+        device->arrival_us = vt_audio_now_us ();
+      vt_audio_stream_begin (audio);
       break;
-      case 'a':
-      {
-        int bin_length = audio->data_size;
-        if (bin_length)
-        {
-        uint8_t *data2 = malloc ((unsigned int)a85len ((char*)audio->data, audio->data_size) + 1);
-        // a85len is inaccurate but gives an upper bound,
-        // should be fixed.
-        bin_length = a85dec ((char*)audio->data,
-                                (void*)data2,
-                                bin_length);
-        free (audio->data);
-        audio->data = data2;
-        audio->data_size = bin_length;
-        }
-      }
+    case 'u': // upload, decoded like a transfer into the sample cache
+      audio->upload = calloc (sizeof (VtAudioSample), 1);
+      audio->upload->id = sample_id;
+      if (audio->upload_resample)
+        apc_resample_reset (audio->upload_resample);
+      vt_audio_stream_begin (audio);
       break;
-
-      case 'b':
+    case 'x': // trigger a cached sample
+      if (vt_audio_sample_play (sample_id, gain >= 0 ? gain : 100, rate))
       {
-        int bin_length = audio->data_size;
-        uint8_t *data2 = malloc (audio->data_size);
-        bin_length = ctx_base642bin ((char*)audio->data,
-                                     &bin_length,
-                                     data2);
-        memcpy (audio->data, data2, bin_length + 1);
-        audio->data_size = bin_length;
-        free (data2);
+        char buf[64];
+        sprintf (buf, "\033_Aa=x,I=%i;ENOENT\033\\", sample_id);
+        vt_write (vt, buf, strlen (buf));
       }
       break;
-    }
-
-    if (audio->frames)
-    switch (audio->compression)
-    {
-      case 'z':
-    {
-      unsigned long actual_uncompressed_size = audio->frames * audio->bits/8 * audio->channels + 512;
-      unsigned char *data2 = malloc (actual_uncompressed_size);
-      /* if a buf size is set (rather compression, but
-       * this works first..) then */
-      int z_result = uncompress (data2, &actual_uncompressed_size,
-                                 audio->data,
-                                 audio->data_size);
-      if (z_result != Z_OK)
-      {
-       // fprintf (stderr, "[z error %i %i]", __LINE__, z_result);
-      }
-
-#if 0
-      // XXX : we seem to get buf-error (-5) here, which indicates not enough
-      //       space in output buffer, which is odd
-      //
-      //       it is non fatal though so we ignore it and use the validly
-      //       decompressed bits.
-      {
-        char buf[256];
-        sprintf (buf, "\e_Ao=z;zlib error1 %i\e\\", z_result);
-        vt_write (vt, buf, strlen(buf));
-        //goto cleanup;
-      }
-#endif
-      free (audio->data);
-      audio->data = data2;
-      audio->data_size = actual_uncompressed_size;
-    }
-
-        break;
-      case 'o':
-        break;
-      default:
-        break;
-    }
-
-    if (audio->frames == 0)
-    {
-      /* implicit frame count */
-      audio->frames = audio->data_size /
-                                (audio->bits/8) /
-                                   audio->channels;
-    }
-
-
-#if 0
-    if (audio->format == 100/* opus */)
-    {
-      int channels;
-      uint8_t *new_data = NULL;//stbi_load_from_memory (audio->data, audio->data_size, &audio->buf_width, &audio->buf_height, &channels, 4);
-
-      if (!new_data)
-      {
-        char buf[256]= "\e_Gf=100;audio decode error\e\\";
-        vt_write (vt, buf, strlen(buf));
-        goto cleanup;
-      }
-      audio->format = 32;
-      free (audio->data);
-      audio->data = new_data;
-      audio->data_size = audio->buf_width * audio->buf_height * 4;
-    }
-#endif
-
-  switch (audio->action)
-  {
-    case 't': // transfer
-       if (audio->type == 'u') // implied 8bit
-       {
-         if (audio->channels == 2)
-         {
-           for (int i = 0; i < audio->frames; i++)
-           {
-             int val_left = MuLawDecompressTable[audio->data[i*2]];
-             int val_right = MuLawDecompressTable[audio->data[i*2+1]];
-             terminal_queue_pcm (val_left, val_right);
-           }
-         }
-         else
-         {
-           for (int i = 0; i < audio->frames; i++)
-           {
-             int val = MuLawDecompressTable[audio->data[i]];
-             terminal_queue_pcm (val, val);
-           }
-         }
-       }
-       else if (audio->type == 's')
-       {
-         if (audio->bits == 8)
-         {
-           if (audio->channels == 2)
-           {
-             for (int i = 0; i < audio->frames; i++)
-             {
-               int val_left = 256*((int8_t*)(audio->data))[i*2];
-               int val_right = 256*((int8_t*)(audio->data))[i*2+1];
-               terminal_queue_pcm (val_left, val_right);
-             }
-           }
-           else
-           {
-             for (int i = 0; i < audio->frames; i++)
-             {
-               int val = 256*((int8_t*)(audio->data))[i];
-               terminal_queue_pcm (val, val);
-             }
-           }
-         }
-         else
-         {
-           if (audio->channels == 2)
-           {
-             for (int i = 0; i < audio->frames; i++)
-             {
-               int val_left = ((int16_t*)(audio->data))[i*2];
-               int val_right = ((int16_t*)(audio->data))[i*2+1];
-               terminal_queue_pcm (val_left, val_right);
-             }
-           }
-           else
-           {
-             for (int i = 0; i < audio->frames; i++)
-             {
-               int val = ((int16_t*)(audio->data))[i];
-               terminal_queue_pcm (val, val);
-             }
-           }
-         }
-       }
-       free (audio->data);
-       audio->data = NULL;
-       audio->data_size=0;
-       break;
+    case 'p': // playback position
+      vt_audio_position (vt);
+      break;
+    case 'f': // flush
+      vt_audio_flush (vt, stream);
+      break;
+    case 'h': // hold
+      vt_audio_pause (device, stream, 1);
+      break;
+    case 'r': // resume
+      vt_audio_pause (device, stream, 0);
+      break;
+    case 's': // silence, a packet suppressed by the sender
+      vt_audio_silence (audio, audio->frames, audio->noise);
+      break;
     case 'q': // query
        {
          char buf[512];
-         sprintf (buf, "\033_As=%i,b=%i,c=%i,T=%c,B=%i,e=%c,o=%c;OK\033\\",
+         sprintf (buf, "\033_As=%i,b=%i,c=%i,T=%c,B=%i,e=%c,o=%c,p=%i,d=%i;OK\033\\",
       audio->samplerate, audio->bits, audio->channels, audio->type,
       audio->buffer_size,
       audio->encoding?audio->encoding:'0',
-      audio->compression?audio->compression:'0'
+      audio->compression?audio->compression:'0',
+      device->pull,
+      device->dtx
       /*audio->transmission*/);
 
          vt_write (vt, buf, strlen(buf));
        }
       break;
   }
-  }
-
-//cleanup:
-    if (audio->data)
-      free (audio->data);
-    audio->data = NULL;
-    audio->data_size=0;
 }